@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <signal.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -11,132 +12,218 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <pthread.h>
 #include "cpman.h"
 
-char COMPOSE_CMD[256] = {0};
-char DOCKER_CMD[256] = {0};
-char **compose_files = NULL;
-int compose_file_count = 0;
-char *exclude_pattern = NULL;
-int verbose_mode = 0;
-int timeout_seconds = 60;
-int max_depth = 2;
-
-int main(int argc, char *argv[]) {
-    signal(SIGINT, signal_handler);
-
-    int mode = 0;
-    char *path = NULL;
-    char *exclude = NULL;
+typedef struct {
+    char id[72];
+    char state[32];
+    char project[128];
+    char service[128];
+    char config_hash[72];
+    char config_files[1024];
+    char working_dir[PATH_MAX];
+} container_info;
+
+typedef struct {
+    container_info *items;
+    int count;
+} container_snapshot;
+
+enum {
+    EXCLUDE_SUBSTRING,
+    EXCLUDE_GLOB,
+    EXCLUDE_REGEX
+};
+
+typedef struct {
+    char *pattern;
+    int kind;
+    int negate;
+    int dir_only;
+    int anchored;
+    regex_t regex;
+} exclude_rule;
+
+typedef struct exclude_rules {
+    exclude_rule *rules;
+    int count;
+    char base[PATH_MAX];
+    const struct exclude_rules *parent;
+} exclude_rules;
+
+typedef struct {
+    cpman_ctx *ctx;
+    const exclude_rules *matcher;
+    int error;
+} traversal;
+
+static void free_exclude_rules(exclude_rules *set);
+
+void cpman_init(cpman_ctx *ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->timeout_seconds = 60;
+    ctx->max_depth = 2;
+    ctx->max_jobs = 1;
+    ctx->pull_jobs = 4;
+    ctx->check_jobs = 4;
+    ctx->pressure_limit.cpu = 80.0;
+    ctx->pressure_limit.io = 40.0;
+    ctx->pressure_limit.memory = 20.0;
+    ctx->pressure_limit.load = 1.5;
+    pthread_mutex_init(&ctx->callback_lock, NULL);
+}
 
-    if (!parse_args(argc, argv, &mode, &path, &exclude)) {
-        return 1;
+static void free_string_list(char **list, int count) {
+    for (int i = 0; i < count; i++) {
+        free(list[i]);
     }
+    free(list);
+}
 
-    exclude_pattern = exclude;
+static int append_string(char ***list, int *count, const char *value) {
+    char *copy = strdup(value);
+    if (!copy) return CPMAN_ERR_NOMEM;
 
-    if (argc > 1 && strcmp(argv[1], "--help") == 0) {
-        print_help();
-        return 0;
+    char **grown = realloc(*list, sizeof(char *) * (*count + 1));
+    if (!grown) {
+        free(copy);
+        return CPMAN_ERR_NOMEM;
     }
+    grown[(*count)++] = copy;
+    *list = grown;
+    return CPMAN_OK;
+}
 
-    if (path && chdir(path) != 0) {
-        perror("Failed to change directory");
-        return 1;
+static int string_in_list(char **list, int count, const char *value) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(list[i], value) == 0) return 1;
     }
+    return 0;
+}
 
-    check_command();
-    find_compose_files();
+void cpman_cleanup(cpman_ctx *ctx) {
+    cpman_free_compose_files(ctx);
+    free_string_list(ctx->exclude_patterns, ctx->exclude_pattern_count);
+    free_string_list(ctx->exclude_regexes, ctx->exclude_regex_count);
+    ctx->exclude_patterns = NULL;
+    ctx->exclude_pattern_count = 0;
+    ctx->exclude_regexes = NULL;
+    ctx->exclude_regex_count = 0;
+    pthread_mutex_destroy(&ctx->callback_lock);
+}
 
-    if (compose_file_count == 0) {
-        printf(YELLOW "No compose files found. Did you specify the correct path? Try adjusting the depth with -d option.\n" NC);
-        return 1;
+const char *cpman_strerror(int err) {
+    switch (err) {
+    case CPMAN_OK: return "Success";
+    case CPMAN_ERR_SYSTEM: return "System call failed";
+    case CPMAN_ERR_NOMEM: return "Memory allocation failed";
+    case CPMAN_ERR_NO_RUNTIME: return "No compatible compose command found";
+    case CPMAN_ERR_INVALID_PATTERN: return "Invalid exclude pattern";
+    case CPMAN_ERR_NOT_FOUND: return "No compose files found";
+    default: return "Unknown error";
     }
+}
 
-    main_menu(mode);
-
-    free_compose_files();
+static void emit_text(cpman_ctx *ctx, cpman_event_type type, cpman_level level,
+                      const char *project, const char *message) {
+    if (!ctx->on_event) return;
 
-    return 0;
+    cpman_event event = { type, level, project, message };
+    pthread_mutex_lock(&ctx->callback_lock);
+    ctx->on_event(&event, ctx->userdata);
+    pthread_mutex_unlock(&ctx->callback_lock);
 }
 
-void main_menu(int mode) {
-    if (mode == 1) {
-        pause_all_compose();
-        return;
-    } else if (mode == 2) {
-        start_all_compose();
-        return;
-    } else if (mode == 3) {
-        update_compose_files();
-        return;
-    }
+__attribute__((format(printf, 5, 6)))
+static void emit(cpman_ctx *ctx, cpman_event_type type, cpman_level level,
+                 const char *project, const char *format, ...) {
+    if (!ctx->on_event) return;
 
-    printf(YELLOW "Please select an option:\n" NC);
-    printf(GREEN "1) Stop all compose services\n" NC);
-    printf(GREEN "2) Start all compose services\n" NC);
-    printf(GREEN "3) Update all compose services (default)\n" NC);
+    char message[2048];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
 
-    char choice[10];
-    fgets(choice, sizeof(choice), stdin);
+    emit_text(ctx, type, level, project, message);
+}
 
-    if (choice[0] == '1') {
-        pause_all_compose();
-    } else if (choice[0] == '2') {
-        start_all_compose();
-    } else {
-        update_compose_files();
-    }
+static void emit_errno(cpman_ctx *ctx, const char *what) {
+    char buffer[256];
+    emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL, "%s: %s", what,
+         strerror_r(errno, buffer, sizeof(buffer)));
 }
 
-int execute_command_with_timeout(const char *command, char *output, size_t output_size, const char *work_dir) {
-    if (verbose_mode) {
-        if (work_dir) {
-            printf(CYAN "Executing in %s: %s\n" NC, work_dir, command);
+static char *read_file_contents(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+
+    size_t length = 0;
+    size_t capacity = 4096;
+    char *contents = malloc(capacity);
+    while (contents) {
+        size_t bytes_read = fread(contents + length, 1, capacity - length - 1, fp);
+        length += bytes_read;
+        if (length + 1 < capacity) break;
+
+        capacity *= 2;
+        char *grown = realloc(contents, capacity);
+        if (!grown) {
+            free(contents);
+            contents = NULL;
         } else {
-            printf(CYAN "Executing: %s\n" NC, command);
+            contents = grown;
         }
     }
+    fclose(fp);
 
-    char original_dir[PATH_MAX];
-    if (work_dir) {
-        if (!getcwd(original_dir, sizeof(original_dir))) {
-            perror("Failed to get current directory");
-            return -1;
-        }
+    if (contents) contents[length] = '\0';
+    return contents;
+}
 
-        if (chdir(work_dir) != 0) {
-            perror("Failed to change to working directory");
-            return -1;
+int cpman_run_command(cpman_ctx *ctx, const char *command, char *output, size_t output_size,
+                      const char *work_dir) {
+    if (ctx->verbose) {
+        if (work_dir) {
+            emit(ctx, CPMAN_EVENT_COMMAND, CPMAN_LEVEL_INFO, NULL, "Executing in %s: %s", work_dir, command);
+        } else {
+            emit(ctx, CPMAN_EVENT_COMMAND, CPMAN_LEVEL_INFO, NULL, "Executing: %s", command);
         }
     }
 
     char temp_file[] = "/tmp/cpman_output_XXXXXX";
     int fd = mkstemp(temp_file);
     if (fd == -1) {
-        perror("Failed to create temporary file");
-        if (work_dir) chdir(original_dir);
-        return -1;
+        emit_errno(ctx, "Failed to create temporary file");
+        return CPMAN_COMMAND_FAILED;
     }
 
-    close(fd);
-
-    char redirect_cmd[2048];
-    snprintf(redirect_cmd, sizeof(redirect_cmd), "%s > %s 2>&1", command, temp_file);
-
     pid_t pid = fork();
     if (pid == -1) {
-        perror("Failed to fork");
+        emit_errno(ctx, "Failed to fork");
+        close(fd);
         unlink(temp_file);
-        if (work_dir) chdir(original_dir);
-        return -1;
+        return CPMAN_COMMAND_FAILED;
     }
 
     if (pid == 0) {
-        execl("/bin/sh", "sh", "-c", redirect_cmd, NULL);
-        exit(1);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+        if (work_dir && chdir(work_dir) != 0) {
+            static const char message[] = "Failed to change to working directory\n";
+            write(STDERR_FILENO, message, sizeof(message) - 1);
+            _exit(127);
+        }
+        execl("/bin/sh", "sh", "-c", command, NULL);
+        _exit(127);
     }
 
+    close(fd);
+
     time_t start_time = time(NULL);
     int status;
     pid_t result;
@@ -147,42 +234,32 @@ int execute_command_with_timeout(const char *command, char *output, size_t outpu
         if (result == pid) {
             break;
         } else if (result == -1) {
-            perror("waitpid failed");
+            emit_errno(ctx, "waitpid failed");
             kill(pid, SIGKILL);
             unlink(temp_file);
-            if (work_dir) chdir(original_dir);
-            return -1;
+            return CPMAN_COMMAND_FAILED;
         }
 
-        if (time(NULL) - start_time > timeout_seconds) {
-            printf(RED "\nCommand timed out after %d seconds. Show output? [y/N]: " NC, timeout_seconds);
-            fflush(stdout);
-
-            char response[10];
-            fgets(response, sizeof(response), stdin);
-            if (response[0] == 'y' || response[0] == 'Y') {
-                FILE *fp = fopen(temp_file, "r");
-                if (fp) {
-                    char buffer[256];
-                    printf(YELLOW "\n--- Command Output ---\n" NC);
-                    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-                        printf("%s", buffer);
-                    }
-                    printf(YELLOW "\n--- End Output ---\n" NC);
-                    fclose(fp);
-                }
+        if (time(NULL) - start_time > ctx->timeout_seconds) {
+            cpman_timeout_action action = CPMAN_TIMEOUT_KILL;
+            if (ctx->on_timeout) {
+                char *partial = read_file_contents(temp_file);
+                pthread_mutex_lock(&ctx->callback_lock);
+                action = ctx->on_timeout(command, partial ? partial : "", ctx->timeout_seconds, ctx->userdata);
+                pthread_mutex_unlock(&ctx->callback_lock);
+                free(partial);
             }
 
-            printf(YELLOW "Terminate the process? [Y/n]: " NC);
-            fgets(response, sizeof(response), stdin);
-            if (response[0] != 'n' && response[0] != 'N') {
+            if (action == CPMAN_TIMEOUT_KILL) {
                 kill(pid, SIGTERM);
                 sleep(1);
                 kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
                 timed_out = 1;
                 break;
             } else {
-                printf(YELLOW "Continuing to wait for the process to complete...\n" NC);
+                emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL,
+                     "Continuing to wait for the process to complete...");
                 start_time = time(NULL);
             }
         }
@@ -190,19 +267,16 @@ int execute_command_with_timeout(const char *command, char *output, size_t outpu
         usleep(100000);
     }
 
-    FILE *fp = fopen(temp_file, "r");
-    if (fp) {
-        if (verbose_mode) {
-            char buffer[256];
-            printf(YELLOW "\n--- Command Output ---\n" NC);
-            while (fgets(buffer, sizeof(buffer), fp) != NULL) {
-                printf("%s", buffer);
-            }
-            printf(YELLOW "\n--- End Output ---\n" NC);
-
-            rewind(fp);
+    if (ctx->verbose) {
+        char *contents = read_file_contents(temp_file);
+        if (contents) {
+            emit_text(ctx, CPMAN_EVENT_COMMAND_OUTPUT, CPMAN_LEVEL_INFO, NULL, contents);
+            free(contents);
         }
+    }
 
+    FILE *fp = fopen(temp_file, "r");
+    if (fp) {
         if (output && output_size > 0) {
             size_t bytes_read = fread(output, 1, output_size - 1, fp);
             output[bytes_read] = '\0';
@@ -215,272 +289,1218 @@ int execute_command_with_timeout(const char *command, char *output, size_t outpu
 
     unlink(temp_file);
 
-    if (work_dir) {
-        if (chdir(original_dir) != 0) {
-            perror("Failed to return to original directory");
-        }
-    }
-
     if (timed_out) {
-        return -2;
+        return CPMAN_COMMAND_TIMEOUT;
     }
 
-    int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
-    if (verbose_mode) {
-        printf(CYAN "Command exited with code: %d\n" NC, exit_code);
+    int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : CPMAN_COMMAND_FAILED;
+    if (ctx->verbose) {
+        emit(ctx, CPMAN_EVENT_COMMAND, CPMAN_LEVEL_INFO, NULL, "Command exited with code: %d", exit_code);
     }
 
     return exit_code;
 }
 
-char *get_image_id(const char *file) {
-    char *file_copy = strdup(file);
-    if (!file_copy) {
-        perror("Failed to allocate memory");
-        return NULL;
+static int append_to_command(char **command, size_t *length, size_t *capacity, const char *text) {
+    size_t text_len = strlen(text);
+    if (*length + text_len + 1 > *capacity) {
+        size_t new_capacity = *capacity ? *capacity : 1024;
+        while (*length + text_len + 1 > new_capacity) new_capacity *= 2;
+        char *grown = realloc(*command, new_capacity);
+        if (!grown) return -1;
+        *command = grown;
+        *capacity = new_capacity;
     }
+    memcpy(*command + *length, text, text_len + 1);
+    *length += text_len;
+    return 0;
+}
 
-    char *dir = dirname(strdup(file_copy));
-    char *base_filename = basename(file_copy);
+static int run_batch_command(cpman_ctx *ctx, const char *prefix, char **ids, int id_count) {
+    if (id_count == 0) return 0;
 
-    char command[1024];
-    char original_dir[PATH_MAX];
+    char *command = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    int failed = append_to_command(&command, &length, &capacity, prefix) != 0;
+    for (int i = 0; i < id_count && !failed; i++) {
+        failed = append_to_command(&command, &length, &capacity, " ") != 0 ||
+                 append_to_command(&command, &length, &capacity, ids[i]) != 0;
+    }
+    if (failed) {
+        emit_errno(ctx, "Failed to allocate memory");
+        free(command);
+        return CPMAN_COMMAND_FAILED;
+    }
 
-    if (!getcwd(original_dir, sizeof(original_dir))) {
-        perror("Failed to get current directory");
-        free(file_copy);
-        free(dir);
-        return NULL;
+    char output_buffer[4096];
+    int result = cpman_run_command(ctx, command, output_buffer, sizeof(output_buffer), NULL);
+    free(command);
+    return result;
+}
+
+static FILE *open_command(cpman_ctx *ctx, const char *command) {
+    if (ctx->verbose) {
+        emit(ctx, CPMAN_EVENT_COMMAND, CPMAN_LEVEL_INFO, NULL, "Executing: %s", command);
     }
+    return popen(command, "r");
+}
 
-    if (chdir(dir) != 0) {
-        perror("Failed to change to compose file directory");
+/* Optionally also collects the local ID of every image the project uses. */
+static int image_fingerprint(cpman_ctx *ctx, const char *file, char *fingerprint, size_t size,
+                             char ***image_ids, int *image_id_count) {
+    char *file_copy = strdup(file);
+    char *dir_copy = strdup(file);
+    if (!file_copy || !dir_copy) {
         free(file_copy);
-        free(dir);
-        return NULL;
+        free(dir_copy);
+        emit_errno(ctx, "Failed to allocate memory");
+        return CPMAN_ERR_NOMEM;
     }
 
-    snprintf(command, sizeof(command), "%s -f \"%s\" config | grep 'image:' | awk '{print $2}'",
-             COMPOSE_CMD, base_filename);
+    const char *dir = dirname(dir_copy);
+    const char *base_filename = basename(file_copy);
 
-    FILE *fp = popen(command, "r");
+    char command[2048];
+    snprintf(command, sizeof(command), "cd \"%s\" && %s -f \"%s\" config | grep 'image:' | awk '{print $2}'",
+             dir, ctx->compose_cmd, base_filename);
+
+    free(file_copy);
+    free(dir_copy);
+
+    FILE *fp = open_command(ctx, command);
     if (!fp) {
-        chdir(original_dir);
-        free(file_copy);
-        free(dir);
-        return NULL;
+        emit_errno(ctx, "Failed to run command");
+        return CPMAN_ERR_SYSTEM;
     }
 
     char images[4096] = {0};
     char line[256];
     while (fgets(line, sizeof(line), fp) != NULL) {
-        strcat(images, line);
+        if (strlen(images) + strlen(line) < sizeof(images)) {
+            strcat(images, line);
+        }
     }
     pclose(fp);
 
-    if (chdir(original_dir) != 0) {
-        perror("Failed to return to original directory");
-    }
-
-    free(file_copy);
-    free(dir);
-
     char digests[8192] = {0};
 
-    char *image = strtok(images, "\n");
+    char *saveptr = NULL;
+    char *image = strtok_r(images, "\n", &saveptr);
     while (image != NULL) {
-        snprintf(command, sizeof(command), "%s image inspect --format='{{index .RepoDigests 0}}' \"%s\" 2>/dev/null",
-                DOCKER_CMD, image);
+        snprintf(command, sizeof(command),
+                 "%s image inspect --format='{{.Id}}{{range .RepoDigests}} {{.}}{{end}}' \"%s\" 2>/dev/null",
+                 ctx->docker_cmd, image);
 
         fp = popen(command, "r");
         if (!fp) {
-            fprintf(stderr, "Failed to run command: %s\n", command);
-            return NULL;
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, file, "Failed to run command: %s", command);
+            return CPMAN_ERR_SYSTEM;
         }
 
+        char inspect[2048] = {0};
+        char image_id[128] = {0};
         char digest[512] = {0};
-        if (fgets(digest, sizeof(digest), fp) == NULL) {
-            strcpy(digest, image);
+        if (fgets(inspect, sizeof(inspect), fp) != NULL) {
+            sscanf(inspect, "%127s %511s", image_id, digest);
+        }
+        if (!digest[0]) {
+            snprintf(digest, sizeof(digest), "%s", image);
         }
 
-        strtok(digest, "\n");
+        if (image_ids && image_id[0] && append_string(image_ids, image_id_count, image_id) != CPMAN_OK) {
+            pclose(fp);
+            emit_errno(ctx, "Failed to allocate memory");
+            return CPMAN_ERR_NOMEM;
+        }
 
-        strcat(digests, digest);
-        strcat(digests, "\n");
+        if (strlen(digests) + strlen(digest) + 2 < sizeof(digests)) {
+            strcat(digests, digest);
+            strcat(digests, "\n");
+        }
 
         pclose(fp);
 
-        image = strtok(NULL, "\n");
+        image = strtok_r(NULL, "\n", &saveptr);
     }
 
-    char sorted_digests[8192];
-    snprintf(command, sizeof(command), "echo \"%s\" | sort", digests);
-    fp = popen(command, "r");
-    if (!fp) return NULL;
-
-    sorted_digests[0] = '\0';
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        strcat(sorted_digests, line);
+    char pipeline[16384];
+    snprintf(pipeline, sizeof(pipeline), "echo \"%s\" | sort | md5sum", digests);
+    fp = popen(pipeline, "r");
+    if (!fp) {
+        emit_errno(ctx, "Failed to run command");
+        return CPMAN_ERR_SYSTEM;
     }
-    pclose(fp);
 
-    char md5_command[16384];
-    snprintf(md5_command, sizeof(md5_command), "echo \"%s\" | md5sum", sorted_digests);
-    fp = popen(md5_command, "r");
-    if (!fp) return NULL;
-
-    static char md5sum[33];
+    char md5sum[33] = {0};
     if (fgets(line, sizeof(line), fp) != NULL) {
         sscanf(line, "%32s", md5sum);
     }
     pclose(fp);
 
-    return md5sum;
+    snprintf(fingerprint, size, "%s", md5sum);
+    return CPMAN_OK;
 }
 
-void update_compose_files() {
-    char before_pull[33];
-    char after_pull[33];
-    char output_buffer[4096];
+int cpman_image_fingerprint(cpman_ctx *ctx, const char *file, char *fingerprint, size_t size) {
+    return image_fingerprint(ctx, file, fingerprint, size, NULL, NULL);
+}
 
-    for (int i = 0; i < compose_file_count; i++) {
-        const char *compose_file = compose_files[i];
-        printf(CYAN "Updating %s...\n" NC, compose_file);
+static void copy_field(char *dest, size_t dest_size, const char *src) {
+    snprintf(dest, dest_size, "%s", src ? src : "");
+}
 
-        char *file_copy = strdup(compose_file);
-        if (!file_copy) {
-            perror("Failed to allocate memory");
-            continue;
+static void free_container_snapshot(container_snapshot *snapshot) {
+    free(snapshot->items);
+    snapshot->items = NULL;
+    snapshot->count = 0;
+}
+
+static int load_container_snapshot(cpman_ctx *ctx, container_snapshot *snapshot) {
+    snapshot->items = NULL;
+    snapshot->count = 0;
+
+    char command[1024];
+    snprintf(command, sizeof(command),
+             "%s ps -a --filter label=com.docker.compose.project --format "
+             "'{{.ID}}\t{{.State}}\t{{.Label \"com.docker.compose.project\"}}\t"
+             "{{.Label \"com.docker.compose.service\"}}\t{{.Label \"com.docker.compose.config-hash\"}}\t"
+             "{{.Label \"com.docker.compose.project.config_files\"}}\t"
+             "{{.Label \"com.docker.compose.project.working_dir\"}}\t"
+             "{{.Label \"com.docker.compose.oneoff\"}}' 2>/dev/null",
+             ctx->docker_cmd);
+
+    FILE *fp = open_command(ctx, command);
+    if (!fp) return CPMAN_ERR_SYSTEM;
+
+    int capacity = 0;
+    char line[8192];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+
+        char *fields[8] = {0};
+        int field_count = 0;
+        char *cursor = line;
+        while (field_count < 8) {
+            fields[field_count++] = cursor;
+            char *tab = strchr(cursor, '\t');
+            if (!tab) break;
+            *tab = '\0';
+            cursor = tab + 1;
         }
-        char *compose_dir = dirname(file_copy);
 
-        char *image_id = get_image_id(compose_file);
-        if (image_id) {
-            strncpy(before_pull, image_id, 32);
-            before_pull[32] = '\0';
-        } else {
-            printf(RED "Failed to get image digest before pull\n" NC);
-            free(file_copy);
-            continue;
+        if (field_count < 4 || !*fields[0] || !*fields[2]) continue;
+        if (fields[7] && strcmp(fields[7], "True") == 0) continue;
+
+        if (snapshot->count >= capacity) {
+            int new_capacity = capacity ? capacity * 2 : 64;
+            container_info *items = realloc(snapshot->items, sizeof(container_info) * new_capacity);
+            if (!items) {
+                emit_errno(ctx, "Failed to allocate memory");
+                pclose(fp);
+                free_container_snapshot(snapshot);
+                return CPMAN_ERR_NOMEM;
+            }
+            snapshot->items = items;
+            capacity = new_capacity;
         }
 
-        char pull_command[1024];
-        snprintf(pull_command, sizeof(pull_command), "%s -f \"%s\" pull", COMPOSE_CMD, compose_file);
+        container_info *container = &snapshot->items[snapshot->count++];
+        copy_field(container->id, sizeof(container->id), fields[0]);
+        copy_field(container->state, sizeof(container->state), fields[1]);
+        copy_field(container->project, sizeof(container->project), fields[2]);
+        copy_field(container->service, sizeof(container->service), fields[3]);
+        copy_field(container->config_hash, sizeof(container->config_hash), fields[4]);
+        copy_field(container->config_files, sizeof(container->config_files), fields[5]);
+        copy_field(container->working_dir, sizeof(container->working_dir), fields[6]);
+    }
 
-        printf(YELLOW "Pulling images (timeout: %d seconds)...\n" NC, timeout_seconds);
-        int result = execute_command_with_timeout(pull_command, output_buffer, sizeof(output_buffer), compose_dir);
+    if (pclose(fp) != 0) {
+        free_container_snapshot(snapshot);
+        return CPMAN_ERR_SYSTEM;
+    }
 
-        if (result == -2) {
-            printf(RED "Pull command timed out.\n" NC);
-            free(file_copy);
-            continue;
-        } else if (result != 0) {
-            printf(RED "Pull command failed with exit code %d.\n" NC, result);
-            free(file_copy);
-            continue;
+    if (ctx->verbose) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_INFO, NULL, "Found %d compose containers", snapshot->count);
+    }
+
+    return CPMAN_OK;
+}
+
+static int container_belongs_to(const container_info *container, const char *compose_file) {
+    if (container->config_files[0]) {
+        size_t file_len = strlen(compose_file);
+        const char *entry = container->config_files;
+        while (*entry) {
+            size_t entry_len = strcspn(entry, ",");
+            if (entry_len == file_len && strncmp(entry, compose_file, file_len) == 0) {
+                return 1;
+            }
+            entry += entry_len;
+            if (*entry == ',') entry++;
         }
+        return 0;
+    }
 
-        image_id = get_image_id(compose_file);
-        if (image_id) {
-            strncpy(after_pull, image_id, 32);
-            after_pull[32] = '\0';
-        } else {
-            printf(RED "Failed to get image digest after pull\n" NC);
-            free(file_copy);
+    if (!container->working_dir[0]) return 0;
+
+    const char *slash = strrchr(compose_file, '/');
+    if (!slash) return 0;
+    size_t dir_len = (size_t)(slash - compose_file);
+    return strlen(container->working_dir) == dir_len &&
+           strncmp(container->working_dir, compose_file, dir_len) == 0;
+}
+
+enum {
+    PROJECT_UNKNOWN,
+    PROJECT_MISSING,
+    PROJECT_STOPPED,
+    PROJECT_DRIFTED,
+    PROJECT_CURRENT
+};
+
+/*
+ * Compares the project's containers with the hashes 'compose config --hash'
+ * computes for the current configuration. PROJECT_DRIFTED is only returned
+ * for a definite hash mismatch or a configured service without a container;
+ * when the hashes cannot be obtained or the containers carry no Docker
+ * config-hash label (e.g. podman-compose) the result is PROJECT_UNKNOWN.
+ * A project with a container that is not running is reported as
+ * PROJECT_STOPPED without calling compose at all, so update never starts
+ * what the user stopped.
+ */
+static int project_state(cpman_ctx *ctx, const container_snapshot *snapshot,
+                         const char *compose_file, const char *compose_dir) {
+    int containers = 0;
+    for (int i = 0; i < snapshot->count; i++) {
+        const container_info *container = &snapshot->items[i];
+        if (!container_belongs_to(container, compose_file)) continue;
+        if (!container->config_hash[0]) return PROJECT_UNKNOWN;
+        if (strcmp(container->state, "running") != 0) return PROJECT_STOPPED;
+        containers++;
+    }
+    if (containers == 0) return PROJECT_MISSING;
+
+    char command[1024];
+    snprintf(command, sizeof(command), "%s -f \"%s\" config --hash '*'", ctx->compose_cmd, compose_file);
+
+    char output[16384];
+    if (cpman_run_command(ctx, command, output, sizeof(output), compose_dir) != 0) {
+        return PROJECT_UNKNOWN;
+    }
+
+    int services = 0;
+    char *saveptr = NULL;
+    for (char *line = strtok_r(output, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char service[128];
+        char hash[72];
+        if (sscanf(line, "%127s %71s", service, hash) != 2 || strlen(hash) != 64 ||
+            strspn(hash, "0123456789abcdef") != 64) {
             continue;
         }
 
-        if (strcmp(before_pull, after_pull) != 0) {
-            printf(GREEN "New images pulled, restarting service...\n" NC);
+        int matched = 0;
+        for (int i = 0; i < snapshot->count; i++) {
+            const container_info *container = &snapshot->items[i];
+            if (strcmp(container->service, service) != 0 ||
+                !container_belongs_to(container, compose_file)) {
+                continue;
+            }
+            if (strcmp(container->config_hash, hash) != 0) return PROJECT_DRIFTED;
+            matched++;
+        }
+
+        if (matched == 0) return PROJECT_DRIFTED;
+        services++;
+    }
 
-            char down_command[1024];
-            snprintf(down_command, sizeof(down_command), "%s -f \"%s\" down", COMPOSE_CMD, compose_file);
+    if (services == 0) return PROJECT_UNKNOWN;
+    return PROJECT_CURRENT;
+}
 
-            result = execute_command_with_timeout(down_command, output_buffer, sizeof(output_buffer), compose_dir);
-            if (result != 0 && result != -2) {
-                printf(RED "Down command failed with exit code %d.\n" NC, result);
-                free(file_copy);
-                continue;
+static int run_compose(cpman_ctx *ctx, const char *compose_file, const char *compose_dir,
+                       const char *arguments, const char *name) {
+    char command[1024];
+    char output_buffer[4096];
+    snprintf(command, sizeof(command), "%s -f \"%s\" %s", ctx->compose_cmd, compose_file, arguments);
+
+    int result = cpman_run_command(ctx, command, output_buffer, sizeof(output_buffer), compose_dir);
+    if (result != 0 && result != CPMAN_COMMAND_TIMEOUT) {
+        emit(ctx, CPMAN_EVENT_PROJECT_FAILED, CPMAN_LEVEL_ERROR, compose_file,
+             "%s command failed with exit code %d.", name, result);
+        return -1;
+    }
+
+    return 0;
+}
+
+static double read_psi_some_avg10(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0.0;
+
+    double avg10 = 0.0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "some avg10=%lf", &avg10) == 1) break;
+    }
+    fclose(fp);
+
+    return avg10;
+}
+
+int cpman_read_host_pressure(cpman_pressure *pressure, void *userdata) {
+    (void)userdata;
+
+    pressure->cpu = read_psi_some_avg10("/proc/pressure/cpu");
+    pressure->io = read_psi_some_avg10("/proc/pressure/io");
+    pressure->memory = read_psi_some_avg10("/proc/pressure/memory");
+    pressure->load = 0.0;
+
+    FILE *fp = fopen("/proc/loadavg", "r");
+    if (!fp) return CPMAN_ERR_SYSTEM;
+
+    double load1 = 0.0;
+    int parsed = fscanf(fp, "%lf", &load1) == 1;
+    fclose(fp);
+    if (!parsed) return CPMAN_ERR_SYSTEM;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pressure->load = load1 / (cpus > 0 ? cpus : 1);
+    return CPMAN_OK;
+}
+
+enum {
+    PRESSURE_IDLE,
+    PRESSURE_BUSY,
+    PRESSURE_HIGH
+};
+
+/* Below half of every limit counts as idle, above any limit as high. */
+static int classify_pressure(const cpman_pressure *pressure, const cpman_pressure *limit) {
+    const double values[] = { pressure->cpu, pressure->io, pressure->memory, pressure->load };
+    const double limits[] = { limit->cpu, limit->io, limit->memory, limit->load };
+
+    int state = PRESSURE_IDLE;
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        if (limits[i] <= 0) continue;
+        if (values[i] > limits[i]) return PRESSURE_HIGH;
+        if (values[i] > limits[i] / 2) state = PRESSURE_BUSY;
+    }
+    return state;
+}
+
+typedef int (*project_fn)(cpman_ctx *ctx, void *data, int index);
+
+typedef struct {
+    cpman_ctx *ctx;
+    void *data;
+    project_fn run_project;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int running;
+    int failed;
+} job_pool;
+
+typedef struct {
+    job_pool *pool;
+    int index;
+} job;
+
+#define ADMISSION_POLL_MS 500
+#define ADMISSION_RAMP_SECONDS 3
+
+static void *run_job(void *arg) {
+    job *work = arg;
+    job_pool *pool = work->pool;
+
+    int result = pool->run_project(pool->ctx, pool->data, work->index);
+    free(work);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running--;
+    if (result != 0) pool->failed++;
+    pthread_cond_signal(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void wait_for_job(job_pool *pool) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += ADMISSION_POLL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&pool->finished, &pool->lock, &deadline);
+}
+
+/*
+ * Runs run_project for every compose file. At most max_jobs projects
+ * run at once; beyond the first, a project is only admitted while the host
+ * is below its pressure limits. The concurrency limit starts at one, grows
+ * by one per ramp interval while the host is idle and halves as soon as a
+ * limit is exceeded, so a loaded host never does worse than a serial run.
+ */
+static int run_projects(cpman_ctx *ctx, int max_jobs, project_fn run_project, void *data) {
+    int failed = 0;
+    pthread_t *threads = NULL;
+
+    if (max_jobs > 1 && ctx->compose_file_count > 0) {
+        threads = malloc(sizeof(pthread_t) * ctx->compose_file_count);
+        if (!threads) emit_errno(ctx, "Failed to allocate memory");
+    }
+
+    if (!threads) {
+        for (int i = 0; i < ctx->compose_file_count; i++) {
+            if (run_project(ctx, data, i) != 0) failed++;
+        }
+        return failed;
+    }
+
+    cpman_pressure_fn pressure_source = ctx->pressure_source ? ctx->pressure_source : cpman_read_host_pressure;
+
+    job_pool pool = { ctx, data, run_project, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    int limit = 1;
+    int state = PRESSURE_IDLE;
+    time_t last_change = time(NULL);
+    int next = 0;
+    int thread_count = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    while (next < ctx->compose_file_count || pool.running > 0) {
+        if (next < ctx->compose_file_count && pool.running > 0) {
+            pthread_mutex_unlock(&pool.lock);
+
+            cpman_pressure pressure = {0};
+            int new_state = PRESSURE_BUSY;
+            if (pressure_source(&pressure, ctx->pressure_userdata) == CPMAN_OK) {
+                new_state = classify_pressure(&pressure, &ctx->pressure_limit);
+            }
+            time_t now = time(NULL);
+
+            if (new_state == PRESSURE_HIGH && (state != PRESSURE_HIGH || now - last_change >= ADMISSION_RAMP_SECONDS)) {
+                int reduced = limit > 1 ? limit / 2 : 1;
+                emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL,
+                     "Host under pressure (cpu %.1f%%, io %.1f%%, memory %.1f%%, load %.2f), "
+                     "limiting to %d concurrent projects",
+                     pressure.cpu, pressure.io, pressure.memory, pressure.load, reduced);
+                limit = reduced;
+                last_change = now;
+            } else if (new_state == PRESSURE_IDLE && limit < max_jobs &&
+                       now - last_change >= ADMISSION_RAMP_SECONDS) {
+                limit++;
+                last_change = now;
+                if (ctx->verbose) {
+                    emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_INFO, NULL,
+                         "Host idle, allowing %d concurrent projects", limit);
+                }
             }
+            state = new_state;
 
-            char up_command[1024];
-            snprintf(up_command, sizeof(up_command), "%s -f \"%s\" up -d", COMPOSE_CMD, compose_file);
+            pthread_mutex_lock(&pool.lock);
+        }
+
+        while (next < ctx->compose_file_count && pool.running < limit &&
+               (pool.running == 0 || state != PRESSURE_HIGH)) {
+            job *work = malloc(sizeof(job));
+            pthread_t thread;
+            if (work) {
+                work->pool = &pool;
+                work->index = next;
+            }
 
-            result = execute_command_with_timeout(up_command, output_buffer, sizeof(output_buffer), compose_dir);
-            if (result != 0 && result != -2) {
-                printf(RED "Up command failed with exit code %d.\n" NC, result);
-                free(file_copy);
+            if (!work || pthread_create(&thread, NULL, run_job, work) != 0) {
+                free(work);
+                int index = next++;
+                pthread_mutex_unlock(&pool.lock);
+                int result = run_project(ctx, data, index);
+                pthread_mutex_lock(&pool.lock);
+                if (result != 0) pool.failed++;
                 continue;
             }
 
-            printf(GREEN "Service restarted.\n" NC);
-        } else {
-            printf(YELLOW "No new images, skipping restart.\n" NC);
+            threads[thread_count++] = thread;
+            pool.running++;
+            next++;
         }
 
-        free(file_copy);
+        if (pool.running > 0) {
+            wait_for_job(&pool);
+        }
+    }
+    failed = pool.failed;
+    pthread_mutex_unlock(&pool.lock);
+
+    /* Workers still touch the pool after signalling; wait until they are gone */
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.finished);
+    return failed;
+}
+
+/* What the pre-pass learned about one project before any operation ran. */
+typedef struct {
+    int state;          /* project_state(), PROJECT_UNKNOWN without a listing */
+    int fingerprinted;  /* before holds the pre-pull fingerprint */
+    char before[33];
+    char **images;      /* image IDs the project resolves to, updated by its pull */
+    int image_count;
+} project_check;
+
+typedef struct {
+    const container_snapshot *snapshot;
+    project_check *checks;
+    int fingerprint;
+} check_run;
+
+static int check_project(cpman_ctx *ctx, void *data, int index) {
+    check_run *run = data;
+    project_check *check = &run->checks[index];
+    const char *compose_file = ctx->compose_files[index];
+
+    if (run->fingerprint) {
+        check->fingerprinted = image_fingerprint(ctx, compose_file, check->before, sizeof(check->before),
+                                                 &check->images, &check->image_count) == CPMAN_OK;
+    }
+    if (!run->snapshot) return 0;
+
+    char *file_copy = strdup(compose_file);
+    if (!file_copy) {
+        emit_errno(ctx, "Failed to allocate memory");
+        return -1;
+    }
+
+    check->state = project_state(ctx, run->snapshot, compose_file, dirname(file_copy));
+    free(file_copy);
+    return 0;
+}
+
+static void free_project_checks(cpman_ctx *ctx, project_check *checks) {
+    for (int i = 0; i < ctx->compose_file_count; i++) {
+        free_string_list(checks[i].images, checks[i].image_count);
+    }
+    free(checks);
+}
+
+/*
+ * Determines the project_state() of every project from one container
+ * listing and, with fingerprint, records the images each project uses.
+ * The desired hashes are computed by compose from the normalised
+ * configuration and cannot be derived from the labels, so every running
+ * project still costs one 'compose config --hash' call; missing and
+ * stopped projects need none. All of this runs on the worker pool, up to
+ * ctx->check_jobs at once, and is finished before the caller pulls
+ * anything, so projects sharing an image tag all compare against the
+ * image as it was before the run, no matter which of them pulls first.
+ */
+static project_check *check_projects(cpman_ctx *ctx, int fingerprint, int *have_snapshot) {
+    project_check *checks = calloc(ctx->compose_file_count ? ctx->compose_file_count : 1, sizeof(project_check));
+    if (!checks) {
+        emit_errno(ctx, "Failed to allocate memory");
+        return NULL;
     }
+
+    container_snapshot snapshot;
+    *have_snapshot = load_container_snapshot(ctx, &snapshot) == CPMAN_OK;
+    if (!*have_snapshot && !fingerprint) return checks;
+
+    check_run run = { *have_snapshot ? &snapshot : NULL, checks, fingerprint };
+    run_projects(ctx, ctx->check_jobs, check_project, &run);
+
+    if (*have_snapshot) free_container_snapshot(&snapshot);
+    return checks;
 }
 
-void pause_all_compose() {
+enum {
+    PULL_FAILED = -1,
+    PULL_UNCHANGED,
+    PULL_CHANGED,
+    PULL_DRIFTED
+};
+
+/*
+ * Pulls one project and compares its images with the ones check_projects()
+ * recorded before the run, reporting whether it needs a restart. When the
+ * images changed, the IDs of the images the project used before the pull
+ * that it no longer uses are returned in superseded.
+ */
+static int pull_project(cpman_ctx *ctx, project_check *check,
+                        const char *compose_file, const char *compose_dir,
+                        char ***superseded, int *superseded_count) {
+    char after_pull[33];
     char output_buffer[4096];
+    char **new_images = NULL;
+    int new_image_count = 0;
+    int status = PULL_FAILED;
+
+    if (!check->fingerprinted) {
+        emit(ctx, CPMAN_EVENT_PROJECT_FAILED, CPMAN_LEVEL_ERROR, compose_file,
+             "Failed to get image digest before pull");
+        goto out;
+    }
 
-    for (int i = 0; i < compose_file_count; i++) {
-        const char *compose_file = compose_files[i];
-        printf(CYAN "Stopping services in %s...\n" NC, compose_file);
+    char pull_command[1024];
+    snprintf(pull_command, sizeof(pull_command), "%s -f \"%s\" pull", ctx->compose_cmd, compose_file);
 
-        char *file_copy = strdup(compose_file);
-        if (!file_copy) {
-            perror("Failed to allocate memory");
-            continue;
+    emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, compose_file,
+         "Pulling images (timeout: %d seconds)...", ctx->timeout_seconds);
+    int result = cpman_run_command(ctx, pull_command, output_buffer, sizeof(output_buffer), compose_dir);
+
+    if (result == CPMAN_COMMAND_TIMEOUT) {
+        emit(ctx, CPMAN_EVENT_PROJECT_FAILED, CPMAN_LEVEL_ERROR, compose_file, "Pull command timed out.");
+        goto out;
+    } else if (result != 0) {
+        emit(ctx, CPMAN_EVENT_PROJECT_FAILED, CPMAN_LEVEL_ERROR, compose_file,
+             "Pull command failed with exit code %d.", result);
+        goto out;
+    }
+
+    if (image_fingerprint(ctx, compose_file, after_pull, sizeof(after_pull),
+                          &new_images, &new_image_count) != CPMAN_OK) {
+        emit(ctx, CPMAN_EVENT_PROJECT_FAILED, CPMAN_LEVEL_ERROR, compose_file,
+             "Failed to get image digest after pull");
+        goto out;
+    }
+
+    if (strcmp(check->before, after_pull) != 0) {
+        status = PULL_CHANGED;
+        for (int i = 0; superseded && i < check->image_count; i++) {
+            if (string_in_list(new_images, new_image_count, check->images[i]) ||
+                string_in_list(*superseded, *superseded_count, check->images[i])) {
+                continue;
+            }
+            if (append_string(superseded, superseded_count, check->images[i]) != CPMAN_OK) {
+                emit_errno(ctx, "Failed to allocate memory");
+                break;
+            }
+        }
+    } else if (check->state == PROJECT_DRIFTED) {
+        status = PULL_DRIFTED;
+    } else {
+        status = PULL_UNCHANGED;
+    }
+
+    free_string_list(check->images, check->image_count);
+    check->images = new_images;
+    check->image_count = new_image_count;
+    new_images = NULL;
+    new_image_count = 0;
+
+out:
+    free_string_list(new_images, new_image_count);
+    return status;
+}
+
+typedef struct {
+    char **images;
+    int count;
+    pthread_mutex_t lock;
+} image_list;
+
+static void add_superseded_images(cpman_ctx *ctx, image_list *garbage, char **images, int count) {
+    pthread_mutex_lock(&garbage->lock);
+    for (int i = 0; i < count; i++) {
+        if (string_in_list(garbage->images, garbage->count, images[i])) continue;
+        if (append_string(&garbage->images, &garbage->count, images[i]) != CPMAN_OK) {
+            emit_errno(ctx, "Failed to allocate memory");
+            break;
         }
-        char *compose_dir = dirname(file_copy);
+    }
+    pthread_mutex_unlock(&garbage->lock);
+}
+
+/*
+ * Removes the superseded images that no container references and no
+ * discovered project resolves to anymore in a single call, optionally at
+ * idle IO priority. 'image rm' only untags an image that has several tags,
+ * but deletes one whose last other tag it removes, so images pinned by
+ * stopped projects have to be skipped here.
+ */
+static void remove_superseded_images(cpman_ctx *ctx, image_list *garbage, const project_check *checks) {
+    if (garbage->count == 0) return;
+
+    for (int i = 0; i < ctx->compose_file_count; i++) {
+        if (!checks[i].fingerprinted) {
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL,
+                 "Could not resolve the images of every project, keeping superseded images.");
+            return;
+        }
+    }
+
+    char command[1024];
+    snprintf(command, sizeof(command),
+             "%s ps -aq | xargs -r %s inspect --format '{{.Image}}' 2>/dev/null",
+             ctx->docker_cmd, ctx->docker_cmd);
+
+    FILE *fp = open_command(ctx, command);
+    if (!fp) {
+        emit_errno(ctx, "Failed to list containers");
+        return;
+    }
+
+    char **in_use = NULL;
+    int in_use_count = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!line[0] || string_in_list(in_use, in_use_count, line)) continue;
+        if (append_string(&in_use, &in_use_count, line) != CPMAN_OK) break;
+    }
+    if (pclose(fp) != 0) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL,
+             "Could not check which images are in use, keeping superseded images.");
+        free_string_list(in_use, in_use_count);
+        return;
+    }
 
-        char down_command[1024];
-        snprintf(down_command, sizeof(down_command), "%s -f \"%s\" down", COMPOSE_CMD, compose_file);
+    char **unused = malloc(sizeof(char *) * garbage->count);
+    int unused_count = 0;
+    for (int i = 0; unused && i < garbage->count; i++) {
+        if (string_in_list(in_use, in_use_count, garbage->images[i])) continue;
 
-        int result = execute_command_with_timeout(down_command, output_buffer, sizeof(output_buffer), compose_dir);
-        if (result != 0 && result != -2) {
-            printf(RED "Down command failed with exit code %d.\n" NC, result);
+        int referenced = 0;
+        for (int j = 0; !referenced && j < ctx->compose_file_count; j++) {
+            referenced = string_in_list(checks[j].images, checks[j].image_count, garbage->images[i]);
+        }
+        if (!referenced) unused[unused_count++] = garbage->images[i];
+    }
+
+    if (unused_count > 0) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_INFO, NULL, "Removing %d superseded images...", unused_count);
+
+        char prefix[512];
+        snprintf(prefix, sizeof(prefix), "%s%s image rm", ctx->gc_ionice ? "ionice -c 3 " : "", ctx->docker_cmd);
+        int result = run_batch_command(ctx, prefix, unused, unused_count);
+        if (result == 0) {
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_SUCCESS, NULL, "Removed %d superseded images.", unused_count);
+        } else {
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL,
+                 "Some superseded images could not be removed (exit code %d).", result);
+        }
+    } else if (ctx->verbose) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_INFO, NULL, "All superseded images are still in use.");
+    }
+
+    free(unused);
+    free_string_list(in_use, in_use_count);
+}
+
+static int restart_project(cpman_ctx *ctx, const char *compose_file, const char *compose_dir, int status) {
+    if (status == PULL_CHANGED) {
+        if (run_compose(ctx, compose_file, compose_dir, "down", "Down") != 0 ||
+            run_compose(ctx, compose_file, compose_dir, "up -d", "Up") != 0) {
+            return -1;
+        }
+
+        emit(ctx, CPMAN_EVENT_PROJECT_DONE, CPMAN_LEVEL_SUCCESS, compose_file, "Service restarted.");
+    } else if (status == PULL_DRIFTED) {
+        if (run_compose(ctx, compose_file, compose_dir, "up -d", "Up") != 0) {
+            return -1;
+        }
+
+        emit(ctx, CPMAN_EVENT_PROJECT_DONE, CPMAN_LEVEL_SUCCESS, compose_file, "Service updated.");
+    }
+
+    return 0;
+}
+
+typedef struct {
+    project_check *checks;
+    image_list garbage;
+} update_run;
+
+static int update_project(cpman_ctx *ctx, void *data, int index) {
+    update_run *run = data;
+    const char *compose_file = ctx->compose_files[index];
+
+    emit(ctx, CPMAN_EVENT_PROJECT_BEGIN, CPMAN_LEVEL_INFO, compose_file, "Updating %s...", compose_file);
+
+    char *file_copy = strdup(compose_file);
+    if (!file_copy) {
+        emit_errno(ctx, "Failed to allocate memory");
+        return -1;
+    }
+    char *compose_dir = dirname(file_copy);
+
+    char **superseded = NULL;
+    int superseded_count = 0;
+    int status = pull_project(ctx, &run->checks[index], compose_file, compose_dir, &superseded, &superseded_count);
+    int result = 0;
+
+    if (status == PULL_FAILED) {
+        result = -1;
+    } else if (status == PULL_CHANGED) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_SUCCESS, compose_file, "New images pulled, restarting service...");
+        result = restart_project(ctx, compose_file, compose_dir, status);
+        if (result == 0) add_superseded_images(ctx, &run->garbage, superseded, superseded_count);
+    } else if (status == PULL_DRIFTED) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_SUCCESS, compose_file,
+             "No new images, but configuration changed. Applying...");
+        result = restart_project(ctx, compose_file, compose_dir, status);
+    } else {
+        emit(ctx, CPMAN_EVENT_PROJECT_SKIPPED, CPMAN_LEVEL_NOTICE, compose_file, "No new images, skipping restart.");
+    }
+
+    free_string_list(superseded, superseded_count);
+    free(file_copy);
+    return result;
+}
+
+int cpman_update(cpman_ctx *ctx) {
+    int have_snapshot;
+    project_check *checks = check_projects(ctx, 1, &have_snapshot);
+    if (!checks) return CPMAN_ERR_NOMEM;
+
+    update_run run = { checks, { NULL, 0, PTHREAD_MUTEX_INITIALIZER } };
+    int failed = run_projects(ctx, ctx->max_jobs, update_project, &run);
+
+    if (ctx->gc_images) remove_superseded_images(ctx, &run.garbage, checks);
+
+    free_string_list(run.garbage.images, run.garbage.count);
+    pthread_mutex_destroy(&run.garbage.lock);
+    free_project_checks(ctx, checks);
+    return failed;
+}
+
+typedef struct {
+    project_check *checks;
+    int *status;
+    char ***superseded;
+    int *superseded_count;
+} staged_update;
+
+static int prepull_project(cpman_ctx *ctx, void *data, int index) {
+    staged_update *update = data;
+    const char *compose_file = ctx->compose_files[index];
+
+    emit(ctx, CPMAN_EVENT_PROJECT_BEGIN, CPMAN_LEVEL_INFO, compose_file, "Pulling %s...", compose_file);
+
+    char *file_copy = strdup(compose_file);
+    if (!file_copy) {
+        emit_errno(ctx, "Failed to allocate memory");
+        update->status[index] = PULL_FAILED;
+        return -1;
+    }
+
+    int status = pull_project(ctx, &update->checks[index], compose_file, dirname(file_copy),
+                              &update->superseded[index], &update->superseded_count[index]);
+    update->status[index] = status;
+    free(file_copy);
+
+    if (status == PULL_CHANGED) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_SUCCESS, compose_file, "New images pulled, restart queued.");
+    } else if (status == PULL_DRIFTED) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_SUCCESS, compose_file, "Configuration changed, restart queued.");
+    } else if (status == PULL_UNCHANGED) {
+        emit(ctx, CPMAN_EVENT_PROJECT_SKIPPED, CPMAN_LEVEL_NOTICE, compose_file, "No new images, skipping restart.");
+    }
+
+    return status == PULL_FAILED ? -1 : 0;
+}
+
+int cpman_staged_update(cpman_ctx *ctx) {
+    int slots = ctx->compose_file_count ? ctx->compose_file_count : 1;
+    int *status = calloc(slots, sizeof(int));
+    char ***superseded = calloc(slots, sizeof(char **));
+    int *superseded_count = calloc(slots, sizeof(int));
+    if (!status || !superseded || !superseded_count) {
+        emit_errno(ctx, "Failed to allocate memory");
+        free(status);
+        free(superseded);
+        free(superseded_count);
+        return CPMAN_ERR_NOMEM;
+    }
+
+    int have_snapshot;
+    project_check *checks = check_projects(ctx, 1, &have_snapshot);
+    if (!checks) {
+        free(status);
+        free(superseded);
+        free(superseded_count);
+        return CPMAN_ERR_NOMEM;
+    }
+    staged_update update = { checks, status, superseded, superseded_count };
+    image_list garbage = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+    emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_INFO, NULL,
+         "Pulling images for %d projects (up to %d at once)...", ctx->compose_file_count, ctx->pull_jobs);
+    int failed = run_projects(ctx, ctx->pull_jobs, prepull_project, &update);
+
+    int pending = 0;
+    for (int i = 0; i < ctx->compose_file_count; i++) {
+        if (status[i] == PULL_CHANGED || status[i] == PULL_DRIFTED) pending++;
+    }
+
+    if (pending == 0) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL, "No projects changed, nothing to restart.");
+    } else {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_INFO, NULL, "Restarting %d changed projects...", pending);
+        time_t window_start = time(NULL);
+
+        for (int i = 0; i < ctx->compose_file_count; i++) {
+            if (status[i] != PULL_CHANGED && status[i] != PULL_DRIFTED) continue;
+
+            const char *compose_file = ctx->compose_files[i];
+            emit(ctx, CPMAN_EVENT_PROJECT_BEGIN, CPMAN_LEVEL_INFO, compose_file, "Restarting %s...", compose_file);
+
+            char *file_copy = strdup(compose_file);
+            if (!file_copy) {
+                emit_errno(ctx, "Failed to allocate memory");
+                failed++;
+                continue;
+            }
+            if (restart_project(ctx, compose_file, dirname(file_copy), status[i]) != 0) {
+                failed++;
+            } else if (status[i] == PULL_CHANGED) {
+                add_superseded_images(ctx, &garbage, superseded[i], superseded_count[i]);
+            }
             free(file_copy);
-            continue;
         }
 
-        printf(BLUE "Services stopped.\n" NC);
-        free(file_copy);
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_SUCCESS, NULL, "Restart window: %ld seconds.",
+             (long)(time(NULL) - window_start));
     }
+
+    if (ctx->gc_images) remove_superseded_images(ctx, &garbage, checks);
+
+    for (int i = 0; i < ctx->compose_file_count; i++) {
+        free_string_list(superseded[i], superseded_count[i]);
+    }
+    free_string_list(garbage.images, garbage.count);
+    pthread_mutex_destroy(&garbage.lock);
+    free_project_checks(ctx, checks);
+    free(superseded_count);
+    free(superseded);
+    free(status);
+    return failed;
 }
 
-void start_all_compose() {
-    char output_buffer[4096];
+static int stop_compose_project(cpman_ctx *ctx, const char *compose_file) {
+    char *file_copy = strdup(compose_file);
+    if (!file_copy) {
+        emit_errno(ctx, "Failed to allocate memory");
+        return -1;
+    }
+    char *compose_dir = dirname(file_copy);
+
+    int result = run_compose(ctx, compose_file, compose_dir, "down", "Down");
+    free(file_copy);
+    return result;
+}
 
-    for (int i = 0; i < compose_file_count; i++) {
-        const char *compose_file = compose_files[i];
-        printf(CYAN "Starting services in %s...\n" NC, compose_file);
+int cpman_stop(cpman_ctx *ctx) {
+    int failed = 0;
+    for (int i = 0; i < ctx->compose_file_count; i++) {
+        const char *compose_file = ctx->compose_files[i];
+        emit(ctx, CPMAN_EVENT_PROJECT_BEGIN, CPMAN_LEVEL_INFO, compose_file, "Stopping services in %s...", compose_file);
 
-        char *file_copy = strdup(compose_file);
-        if (!file_copy) {
-            perror("Failed to allocate memory");
+        if (stop_compose_project(ctx, compose_file) != 0) {
+            failed++;
             continue;
         }
-        char *compose_dir = dirname(file_copy);
 
-        char up_command[1024];
-        snprintf(up_command, sizeof(up_command), "%s -f \"%s\" up -d", COMPOSE_CMD, compose_file);
+        emit(ctx, CPMAN_EVENT_PROJECT_DONE, CPMAN_LEVEL_STATUS, compose_file, "Services stopped.");
+    }
+    return failed;
+}
+
+static int remove_project_networks(cpman_ctx *ctx, char **projects, int project_count) {
+    if (project_count == 0) return 0;
 
-        int result = execute_command_with_timeout(up_command, output_buffer, sizeof(output_buffer), compose_dir);
-        if (result != 0 && result != -2) {
-            printf(RED "Up command failed with exit code %d.\n" NC, result);
-            free(file_copy);
-            continue;
+    char command[1024];
+    snprintf(command, sizeof(command),
+             "%s network ls --filter label=com.docker.compose.project --format "
+             "'{{.ID}}\t{{.Label \"com.docker.compose.project\"}}' 2>/dev/null",
+             ctx->docker_cmd);
+
+    FILE *fp = open_command(ctx, command);
+    if (!fp) return -1;
+
+    char **network_ids = NULL;
+    int network_count = 0;
+    int capacity = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *tab = strchr(line, '\t');
+        if (!tab) continue;
+        *tab = '\0';
+        if (!string_in_list(projects, project_count, tab + 1)) continue;
+
+        if (network_count >= capacity) {
+            int new_capacity = capacity ? capacity * 2 : 16;
+            char **grown = realloc(network_ids, sizeof(char *) * new_capacity);
+            if (!grown) {
+                emit_errno(ctx, "Failed to allocate memory");
+                break;
+            }
+            network_ids = grown;
+            capacity = new_capacity;
         }
 
-        printf(GREEN "Services started.\n" NC);
+        network_ids[network_count] = strdup(line);
+        if (network_ids[network_count]) network_count++;
+    }
+    pclose(fp);
+
+    char prefix[512];
+    snprintf(prefix, sizeof(prefix), "%s network rm", ctx->docker_cmd);
+    int result = run_batch_command(ctx, prefix, network_ids, network_count);
+    if (result == CPMAN_COMMAND_TIMEOUT) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL, "Network remove command timed out.");
+    } else if (result != 0) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL,
+             "Network remove command failed with exit code %d.", result);
+    }
+
+    free_string_list(network_ids, network_count);
+    return result == 0 ? 0 : -1;
+}
+
+int cpman_fast_stop(cpman_ctx *ctx) {
+    container_snapshot snapshot;
+    if (load_container_snapshot(ctx, &snapshot) != CPMAN_OK) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL,
+             "Could not list containers, stopping projects one by one.");
+        return cpman_stop(ctx);
+    }
+
+    char **running_ids = malloc(sizeof(char *) * (snapshot.count + 1));
+    char **all_ids = malloc(sizeof(char *) * (snapshot.count + 1));
+    char **projects = malloc(sizeof(char *) * (snapshot.count + 1));
+    if (!running_ids || !all_ids || !projects) {
+        emit_errno(ctx, "Failed to allocate memory");
+        free(running_ids);
+        free(all_ids);
+        free(projects);
+        free_container_snapshot(&snapshot);
+        return CPMAN_ERR_NOMEM;
+    }
+    int running_count = 0;
+    int all_count = 0;
+    int project_count = 0;
+    int failed = 0;
+
+    for (int i = 0; i < ctx->compose_file_count; i++) {
+        const char *compose_file = ctx->compose_files[i];
+        int matched = 0;
+
+        for (int j = 0; j < snapshot.count; j++) {
+            container_info *container = &snapshot.items[j];
+            if (!container_belongs_to(container, compose_file)) continue;
+            if (string_in_list(all_ids, all_count, container->id)) continue;
+
+            matched++;
+            all_ids[all_count++] = container->id;
+            if (strcmp(container->state, "running") == 0 ||
+                strcmp(container->state, "restarting") == 0 ||
+                strcmp(container->state, "paused") == 0) {
+                running_ids[running_count++] = container->id;
+            }
+            if (!string_in_list(projects, project_count, container->project)) {
+                projects[project_count++] = container->project;
+            }
+        }
+
+        if (matched == 0) {
+            emit(ctx, CPMAN_EVENT_PROJECT_BEGIN, CPMAN_LEVEL_INFO, compose_file,
+                 "No labelled containers found for %s, stopping it with compose...", compose_file);
+            if (stop_compose_project(ctx, compose_file) != 0) failed++;
+        }
+    }
+
+    if (all_count > 0) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_INFO, NULL,
+             "Stopping %d containers across %d projects...", running_count, project_count);
+
+        char prefix[512];
+        snprintf(prefix, sizeof(prefix), "%s stop", ctx->docker_cmd);
+        int result = run_batch_command(ctx, prefix, running_ids, running_count);
+        if (result == CPMAN_COMMAND_TIMEOUT) {
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL,
+                 "Stop command timed out, containers that are still running will not be removed.");
+            failed++;
+        } else if (result != 0) {
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL, "Stop command failed with exit code %d.", result);
+            failed++;
+        }
+
+        snprintf(prefix, sizeof(prefix), "%s rm", ctx->docker_cmd);
+        result = run_batch_command(ctx, prefix, all_ids, all_count);
+        if (result == CPMAN_COMMAND_TIMEOUT) {
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL, "Remove command timed out.");
+            failed++;
+        } else if (result != 0) {
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL, "Remove command failed with exit code %d.", result);
+            failed++;
+        }
+
+        if (remove_project_networks(ctx, projects, project_count) != 0) failed++;
+    }
+
+    if (failed == 0) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_STATUS, NULL, "Services stopped.");
+    } else {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL, "Some services could not be stopped (%d failures).", failed);
+    }
+
+    free(running_ids);
+    free(all_ids);
+    free(projects);
+    free_container_snapshot(&snapshot);
+    return failed;
+}
+
+static int start_project(cpman_ctx *ctx, void *data, int index) {
+    const project_check *checks = data;
+    const char *compose_file = ctx->compose_files[index];
+
+    emit(ctx, CPMAN_EVENT_PROJECT_BEGIN, CPMAN_LEVEL_INFO, compose_file, "Starting services in %s...", compose_file);
+
+    char *file_copy = strdup(compose_file);
+    if (!file_copy) {
+        emit_errno(ctx, "Failed to allocate memory");
+        return -1;
+    }
+    char *compose_dir = dirname(file_copy);
+
+    if (checks[index].state == PROJECT_CURRENT) {
+        emit(ctx, CPMAN_EVENT_PROJECT_SKIPPED, CPMAN_LEVEL_STATUS, compose_file,
+             "Services already running and up to date, skipping.");
         free(file_copy);
+        return 0;
+    }
+
+    int result = run_compose(ctx, compose_file, compose_dir, "up -d", "Up");
+    free(file_copy);
+    if (result != 0) return -1;
+
+    emit(ctx, CPMAN_EVENT_PROJECT_DONE, CPMAN_LEVEL_SUCCESS, compose_file, "Services started.");
+    return 0;
+}
+
+int cpman_start(cpman_ctx *ctx) {
+    int have_snapshot;
+    project_check *checks = check_projects(ctx, 0, &have_snapshot);
+    if (!checks) return CPMAN_ERR_NOMEM;
+    if (!have_snapshot) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL,
+             "Could not list running containers, starting every project.");
     }
+
+    int failed = run_projects(ctx, ctx->max_jobs, start_project, checks);
+
+    free_project_checks(ctx, checks);
+    return failed;
 }
 
-int is_valid_compose_file(const char *filepath) {
+static int is_valid_compose_file(const char *filepath) {
     FILE *fp = fopen(filepath, "r");
     if (!fp) return 0;
 
@@ -496,285 +1516,418 @@ int is_valid_compose_file(const char *filepath) {
     return 0;
 }
 
-void signal_handler(int sig) {
-    (void)sig;
-    printf(RED "\nExiting\n" NC);
-    free_compose_files();
-    exit(1);
+static int find_executable(const char *name, char *path, size_t path_size) {
+    char command[256];
+    snprintf(command, sizeof(command), "which %s 2>/dev/null", name);
+
+    FILE *fp = popen(command, "r");
+    if (!fp) return 0;
+
+    int found = fgets(path, path_size, fp) != NULL;
+    pclose(fp);
+    if (!found) return 0;
+
+    path[strcspn(path, "\n")] = 0;
+    return access(path, X_OK) == 0;
+}
+
+static void use_runtime(cpman_ctx *ctx, const char *compose_cmd, const char *docker_cmd, const char *name) {
+    snprintf(ctx->compose_cmd, sizeof(ctx->compose_cmd), "%s", compose_cmd);
+    snprintf(ctx->docker_cmd, sizeof(ctx->docker_cmd), "%s", docker_cmd);
+    emit(ctx, CPMAN_EVENT_RUNTIME_DETECTED, CPMAN_LEVEL_SUCCESS, NULL, "Using %s", name);
 }
 
-void check_command() {
-    FILE *fp;
+int cpman_detect_runtime(cpman_ctx *ctx) {
     char docker_path[256] = {0};
     char compose_path[256] = {0};
+    char podman_path[256] = {0};
+
+    if (find_executable("docker", docker_path, sizeof(docker_path))) {
+        char command[512];
+        snprintf(command, sizeof(command), "%s compose version > /dev/null 2>&1", docker_path);
+        if (system(command) == 0) {
+            use_runtime(ctx, "docker compose", docker_path, "docker compose");
+            return CPMAN_OK;
+        }
+    }
 
-    fp = popen("which docker", "r");
-    if (fp != NULL && fgets(docker_path, sizeof(docker_path), fp) != NULL) {
-        docker_path[strcspn(docker_path, "\n")] = 0;
-        pclose(fp);
+    if (find_executable("podman-compose", compose_path, sizeof(compose_path)) &&
+        find_executable("podman", podman_path, sizeof(podman_path))) {
+        use_runtime(ctx, compose_path, podman_path, "podman-compose");
+        return CPMAN_OK;
+    }
 
-        if (access(docker_path, X_OK) == 0)
-        {
-            char command[512];
-            snprintf(command, sizeof(command), "%s compose version > /dev/null 2>&1", docker_path);
-            if (system(command) == 0) {
-                strcpy(COMPOSE_CMD, "docker compose");
-                strcpy(DOCKER_CMD, docker_path);
-                printf(GREEN "Using docker compose\n" NC);
-                return;
-            }
-        }
+    emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL, "Trying alternative commands...");
+
+    if (system("command -v docker-compose > /dev/null 2>&1") == 0 &&
+        find_executable("docker", docker_path, sizeof(docker_path))) {
+        use_runtime(ctx, "docker-compose", docker_path, "docker-compose");
+        return CPMAN_OK;
     }
 
-    fp = popen("which podman-compose", "r");
-    if (fp != NULL && fgets(compose_path, sizeof(compose_path), fp) != NULL) {
-        compose_path[strcspn(compose_path, "\n")] = 0;
-        pclose(fp);
-        if (access(compose_path, X_OK) == 0) {
-            fp = popen("which podman", "r");
-            char podman_path[256];
-            if (fp != NULL && fgets(podman_path, sizeof(podman_path), fp) != NULL) {
-                podman_path[strcspn(podman_path, "\n")] = 0;
-                pclose(fp);
-                if (access(podman_path, X_OK) == 0) {
-                    strcpy(COMPOSE_CMD, compose_path);
-                    strcpy(DOCKER_CMD, podman_path);
-                    printf(GREEN "Using podman-compose\n" NC);
-                    return;
-                }
-            }
-            if (fp) pclose(fp);
+    emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL, "No compatible compose command found.");
+    return CPMAN_ERR_NO_RUNTIME;
+}
+
+int cpman_add_exclude(cpman_ctx *ctx, const char *pattern) {
+    return append_string(&ctx->exclude_patterns, &ctx->exclude_pattern_count, pattern);
+}
+
+int cpman_add_exclude_regex(cpman_ctx *ctx, const char *regex) {
+    return append_string(&ctx->exclude_regexes, &ctx->exclude_regex_count, regex);
+}
+
+static int add_exclude_rule(cpman_ctx *ctx, exclude_rules *set, const char *pattern, int kind) {
+    int negate = 0;
+    int dir_only = 0;
+    int anchored = 0;
+
+    if (kind == EXCLUDE_GLOB) {
+        if (pattern[0] == '!') {
+            negate = 1;
+            pattern++;
+        } else if (pattern[0] == '\\' && (pattern[1] == '!' || pattern[1] == '#')) {
+            pattern++;
         }
     }
-    if (fp) pclose(fp);
 
-    printf(YELLOW "Trying alternative commands...\n" NC);
+    char *copy = strdup(pattern);
+    if (!copy) {
+        emit_errno(ctx, "Failed to allocate memory");
+        return CPMAN_ERR_NOMEM;
+    }
 
-    if (system("command -v docker-compose > /dev/null 2>&1") == 0) {
-        fp = popen("which docker", "r");
-        if (fp != NULL && fgets(docker_path, sizeof(docker_path), fp) != NULL) {
-            docker_path[strcspn(docker_path, "\n")] = 0;
-            pclose(fp);
-            if (access(docker_path, X_OK) == 0) {
-                strcpy(COMPOSE_CMD, "docker-compose");
-                strcpy(DOCKER_CMD, docker_path);
-                printf(GREEN "Using docker-compose\n" NC);
-                return;
-            }
+    if (kind == EXCLUDE_GLOB) {
+        size_t len = strlen(copy);
+        while (len > 1 && copy[len - 1] == '/') {
+            copy[--len] = '\0';
+            dir_only = 1;
+        }
+        if (strchr(copy, '/')) anchored = 1;
+        if (copy[0] == '/') memmove(copy, copy + 1, len);
+        if (!*copy) {
+            free(copy);
+            return CPMAN_OK;
+        }
+    }
+
+    exclude_rule *rules = realloc(set->rules, sizeof(exclude_rule) * (set->count + 1));
+    if (!rules) {
+        emit_errno(ctx, "Failed to allocate memory");
+        free(copy);
+        return CPMAN_ERR_NOMEM;
+    }
+    set->rules = rules;
+
+    exclude_rule *rule = &set->rules[set->count];
+    memset(rule, 0, sizeof(*rule));
+    rule->pattern = copy;
+    rule->kind = kind;
+    rule->negate = negate;
+    rule->dir_only = dir_only;
+    rule->anchored = anchored;
+
+    if (kind == EXCLUDE_REGEX) {
+        int err = regcomp(&rule->regex, copy, REG_EXTENDED | REG_NOSUB);
+        if (err != 0) {
+            char message[256];
+            regerror(err, &rule->regex, message, sizeof(message));
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, NULL, "Invalid exclude regex '%s': %s", copy, message);
+            free(copy);
+            return CPMAN_ERR_INVALID_PATTERN;
         }
-        if (fp) pclose(fp);
     }
 
-    printf(RED "No compatible compose command found.\n" NC);
-    exit(1);
+    set->count++;
+    return CPMAN_OK;
 }
 
-void find_compose_files() {
-    compose_files = malloc(sizeof(char *) * 1000);
-    if (!compose_files) {
-        fprintf(stderr, RED "Memory allocation failed\n" NC);
-        exit(1);
+static int compile_exclude_patterns(cpman_ctx *ctx, exclude_rules *set, const char *root) {
+    memset(set, 0, sizeof(*set));
+    snprintf(set->base, sizeof(set->base), "%s", root);
+
+    for (int i = 0; i < ctx->exclude_pattern_count; i++) {
+        const char *pattern = ctx->exclude_patterns[i];
+        if (!*pattern) continue;
+        int kind = strpbrk(pattern, "*?[") ? EXCLUDE_GLOB : EXCLUDE_SUBSTRING;
+        int err = add_exclude_rule(ctx, set, pattern, kind);
+        if (err != CPMAN_OK) {
+            free_exclude_rules(set);
+            return err;
+        }
+    }
+
+    for (int i = 0; i < ctx->exclude_regex_count; i++) {
+        int err = add_exclude_rule(ctx, set, ctx->exclude_regexes[i], EXCLUDE_REGEX);
+        if (err != CPMAN_OK) {
+            free_exclude_rules(set);
+            return err;
+        }
     }
 
-    compose_file_count = 0;
-    traverse_directories(".", 0);
+    return CPMAN_OK;
+}
+
+static void load_ignore_file(cpman_ctx *ctx, exclude_rules *set, const char *dir_path,
+                             const exclude_rules *parent) {
+    memset(set, 0, sizeof(*set));
+    snprintf(set->base, sizeof(set->base), "%s", dir_path);
+    set->parent = parent;
 
-    if (compose_file_count > 0) {
-        printf(YELLOW "Found %d compose files", compose_file_count);
+    char ignore_path[PATH_MAX];
+    snprintf(ignore_path, sizeof(ignore_path), "%s/%s", dir_path, CPMAN_IGNORE_FILE_NAME);
 
-        if (exclude_pattern && *exclude_pattern) {
-            printf(" (excluding '%s')", exclude_pattern);
-        } else {
-            printf(" (ignored directories containing 'ignore')");
+    FILE *fp = fopen(ignore_path, "r");
+    if (!fp) return;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strcspn(line, "\r\n");
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t') &&
+               (len < 2 || line[len - 2] != '\\')) {
+            len--;
         }
+        line[len] = '\0';
 
-        printf(":\n" NC);
+        if (line[0] == '\0' || line[0] == '#') continue;
 
-        for (int i = 0; i < compose_file_count; i++) {
-            printf("%s\n", compose_files[i]);
+        if (add_exclude_rule(ctx, set, line, EXCLUDE_GLOB) != CPMAN_OK) {
+            emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL,
+                 "Warning: Skipping rule '%s' in %s", line, ignore_path);
         }
+    }
+    fclose(fp);
 
-        for (int i = 0; i < compose_file_count; i++) {
-            char abs_path[PATH_MAX];
-            if (realpath(compose_files[i], abs_path) != NULL) {
-                char *temp = strdup(abs_path);
-                if (!temp) {
-                    fprintf(stderr, RED "Memory allocation failed\n" NC);
-                    exit(1);
-                }
-                free(compose_files[i]);
-                compose_files[i] = temp;
-            } else {
-                fprintf(stderr, RED "Error converting path to absolute: %s\n" NC, compose_files[i]);
-            }
+    if (ctx->verbose && set->count > 0) {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_INFO, NULL, "Loaded %d rules from %s", set->count, ignore_path);
+    }
+}
+
+static void free_exclude_rules(exclude_rules *set) {
+    for (int i = 0; i < set->count; i++) {
+        if (set->rules[i].kind == EXCLUDE_REGEX) {
+            regfree(&set->rules[i].regex);
+        }
+        free(set->rules[i].pattern);
+    }
+    free(set->rules);
+    set->rules = NULL;
+    set->count = 0;
+}
+
+static int glob_matches(const char *pattern, const char *text) {
+    if (!strstr(pattern, "**")) return fnmatch(pattern, text, FNM_PATHNAME) == 0;
+
+    /* Without FNM_PATHNAME '*' crosses slashes, so '**' spans directories */
+    if (fnmatch(pattern, text, 0) == 0) return 1;
+
+    /* A leading or inner '**' directory also matches zero directories */
+    if (strncmp(pattern, "**/", 3) == 0 && glob_matches(pattern + 3, text)) return 1;
+    for (const char *p = strstr(pattern, "/**/"); p; p = strstr(p + 1, "/**/")) {
+        char collapsed[PATH_MAX];
+        snprintf(collapsed, sizeof(collapsed), "%.*s%s", (int)(p - pattern), pattern, p + 3);
+        if (glob_matches(collapsed, text)) return 1;
+    }
+    return 0;
+}
+
+static int rule_matches(const exclude_rule *rule, const char *relative, const char *name, int is_dir) {
+    if (rule->dir_only && !is_dir) return 0;
+
+    switch (rule->kind) {
+    case EXCLUDE_SUBSTRING: {
+        /* Matched as if walking "." from the search directory, so the root never matches */
+        char dotted[PATH_MAX + 2];
+        snprintf(dotted, sizeof(dotted), "./%s", relative);
+        return strstr(dotted, rule->pattern) != NULL;
+    }
+    case EXCLUDE_REGEX:
+        return regexec(&rule->regex, relative, 0, NULL, 0) == 0;
+    default:
+        return glob_matches(rule->pattern, rule->anchored ? relative : name);
+    }
+}
+
+static int apply_rules(const exclude_rules *set, const char *path, const char *name,
+                       int is_dir, int excluded) {
+    if (!set) return excluded;
+
+    excluded = apply_rules(set->parent, path, name, is_dir, excluded);
+
+    size_t base_len = strlen(set->base);
+    if (strncmp(path, set->base, base_len) != 0 || path[base_len] != '/') {
+        return excluded;
+    }
+    const char *relative = path + base_len + 1;
+
+    for (int i = 0; i < set->count; i++) {
+        if (rule_matches(&set->rules[i], relative, name, is_dir)) {
+            excluded = !set->rules[i].negate;
         }
-    } else {
-        printf(YELLOW "No compose files found.\n" NC);
     }
+
+    return excluded;
+}
+
+static int is_excluded(const traversal *walk, const exclude_rules *dir_rules, const char *path,
+                       const char *name, int is_dir) {
+    int excluded = is_dir && strstr(name, "ignore") != NULL;
+    excluded = apply_rules(dir_rules, path, name, is_dir, excluded);
+    return apply_rules(walk->matcher, path, name, is_dir, excluded);
+}
+
+static int is_compose_file_name(const char *name) {
+    return strcmp(name, "compose.yaml") == 0 ||
+           strcmp(name, "compose.yml") == 0 ||
+           strcmp(name, "docker-compose.yaml") == 0 ||
+           strcmp(name, "docker-compose.yml") == 0;
+}
+
+static int add_compose_file(cpman_ctx *ctx, const char *path) {
+    if (ctx->compose_file_count >= ctx->compose_file_capacity) {
+        int new_capacity = ctx->compose_file_capacity ? ctx->compose_file_capacity * 2 : 64;
+        char **grown = realloc(ctx->compose_files, sizeof(char *) * new_capacity);
+        if (!grown) return CPMAN_ERR_NOMEM;
+        ctx->compose_files = grown;
+        ctx->compose_file_capacity = new_capacity;
+    }
+
+    ctx->compose_files[ctx->compose_file_count] = strdup(path);
+    if (!ctx->compose_files[ctx->compose_file_count]) return CPMAN_ERR_NOMEM;
+    ctx->compose_file_count++;
+    return CPMAN_OK;
 }
 
-void traverse_directories(const char *base_path, int depth) {
-    if (depth > max_depth) return;
+static void traverse_directories(traversal *walk, const char *base_path, int depth,
+                                 const exclude_rules *parent_rules) {
+    cpman_ctx *ctx = walk->ctx;
+    if (depth > ctx->max_depth) return;
     DIR *dir;
     struct dirent *entry;
 
     if (!(dir = opendir(base_path))) return;
 
-    while ((entry = readdir(dir)) != NULL) {
-        char path[1024];
+    exclude_rules dir_rules;
+    load_ignore_file(ctx, &dir_rules, base_path, parent_rules);
+
+    while (walk->error == CPMAN_OK && (entry = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
             continue;
-        snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
 
-        if (exclude_pattern && *exclude_pattern && strstr(path, exclude_pattern) != NULL) {
+        int is_dir = entry->d_type == DT_DIR;
+        int is_file = entry->d_type == DT_REG;
+
+        if (!is_dir && !is_file && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+            continue;
+        if (is_file && !is_compose_file_name(entry->d_name))
             continue;
-        }
 
-        struct stat statbuf;
-        if (stat(path, &statbuf) == -1) continue;
+        snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
 
-        if (S_ISDIR(statbuf.st_mode)) {
-            if (strstr(entry->d_name, "ignore") != NULL) continue;
-            traverse_directories(path, depth + 1);
-        } else {
-            if (compose_file_count >= 1000) {
-                fprintf(stderr, YELLOW "Warning: Reached maximum compose file limit (1000)\n" NC);
-                break;
-            }
+        if (!is_dir && !is_file) {
+            struct stat statbuf;
+            if (stat(path, &statbuf) == -1) continue;
+            is_dir = S_ISDIR(statbuf.st_mode);
+            is_file = S_ISREG(statbuf.st_mode);
+        }
 
-            if (strcmp(entry->d_name, "compose.yaml") == 0 ||
-                strcmp(entry->d_name, "compose.yml") == 0 ||
-                strcmp(entry->d_name, "docker-compose.yaml") == 0 ||
-                strcmp(entry->d_name, "docker-compose.yml") == 0) {
-
-                if (is_valid_compose_file(path)) {
-                    compose_files[compose_file_count] = strdup(path);
-                    if (!compose_files[compose_file_count]) {
-                        fprintf(stderr, RED "Memory allocation failed\n" NC);
-                        closedir(dir);
-                        exit(1);
-                    }
-                    compose_file_count++;
-                } else if (verbose_mode) {
-                    printf(YELLOW "Skipping non-compose file: %s\n" NC, path);
+        if (is_dir) {
+            if (depth + 1 > ctx->max_depth) continue;
+            if (is_excluded(walk, &dir_rules, path, entry->d_name, 1)) {
+                if (ctx->verbose) {
+                    emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL, "Pruning excluded directory: %s", path);
+                }
+                continue;
+            }
+            traverse_directories(walk, path, depth + 1, &dir_rules);
+        } else if (is_file && is_compose_file_name(entry->d_name)) {
+            if (is_excluded(walk, &dir_rules, path, entry->d_name, 0)) continue;
+
+            if (is_valid_compose_file(path)) {
+                if (add_compose_file(ctx, path) != CPMAN_OK) {
+                    emit_errno(ctx, "Failed to allocate memory");
+                    walk->error = CPMAN_ERR_NOMEM;
                 }
+            } else if (ctx->verbose) {
+                emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL, "Skipping non-compose file: %s", path);
             }
         }
     }
+    free_exclude_rules(&dir_rules);
     closedir(dir);
 }
 
-void free_compose_files() {
-    if (!compose_files) return;
-
-    for (int i = 0; i < compose_file_count; i++) {
-        free(compose_files[i]);
-    }
-    free(compose_files);
-    compose_files = NULL;
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-void print_help() {
-    printf(CYAN "+----------------------------------+\n" NC);
-    printf(CYAN "|              " YELLOW "cpman" CYAN "               |\n" NC);
-    printf(CYAN "|    " GREEN "Compose Project Manager" CYAN "       |\n" NC);
-    printf(CYAN "+----------------------------------+\n\n" NC);
+int cpman_find_compose_files(cpman_ctx *ctx, const char *root) {
+    cpman_free_compose_files(ctx);
 
-    printf(YELLOW "Usage:" NC "  cpman [OPTIONS]\n\n");
+    exclude_rules matcher;
+    int err = compile_exclude_patterns(ctx, &matcher, root);
+    if (err != CPMAN_OK) return err;
 
-    printf(YELLOW "Options:\n" NC);
-    printf("  " GREEN "-p PATH" NC "  Search path for compose files\n");
-    printf("  " GREEN "-m MODE" NC "  Operation mode:\n");
-    printf("           " BLUE "1" NC ": Stop, " BLUE "2" NC ": Start, " BLUE "3" NC ": Update (default)\n");
-    printf("  " GREEN "-e, --exclude PATTERN" NC " Exclude files/directories matching PATTERN\n");
-    printf("  " GREEN "-t, --timeout SECONDS" NC " Set command timeout (default: 60 seconds)\n");
-    printf("  " GREEN "-d, --depth LEVEL" NC " Set maximum directory search depth (default: 2)\n");
-    printf("  " GREEN "-v, --verbose" NC " Show command output on errors\n");
-    printf("  " GREEN "--help" NC "    Show this help message\n\n");
+    traversal walk = { ctx, &matcher, CPMAN_OK };
+    traverse_directories(&walk, root, 0, NULL);
 
-    printf(YELLOW "Description:\n" NC);
-    printf("  Manages Docker Compose projects in the specified\n");
-    printf("  directory and its subdirectories.\n\n");
+    if (walk.error != CPMAN_OK) {
+        free_exclude_rules(&matcher);
+        cpman_free_compose_files(ctx);
+        return walk.error;
+    }
 
-    printf(YELLOW "Example:\n" NC);
-    printf("  cpman -p /projects -m 2 -t 120 -d 1\n\n");
+    if (ctx->compose_file_count > 0) {
+        qsort(ctx->compose_files, ctx->compose_file_count, sizeof(char *), compare_paths);
 
-    printf(YELLOW "Note:" NC " Directories containing 'ignore' are skipped.\n");
-}
+        char summary[2048];
+        int length = snprintf(summary, sizeof(summary),
+                              "Found %d compose files (ignored directories containing 'ignore'",
+                              ctx->compose_file_count);
 
-int parse_args(int argc, char *argv[], int *mode, char **path, char **exclude) {
-    *mode = 3;
-    *path = NULL;
-    *exclude = NULL;
+        for (int i = 0; i < matcher.count && length < (int)sizeof(summary); i++) {
+            length += snprintf(summary + length, sizeof(summary) - length, "%s'%s'",
+                               i == 0 ? ", excluding " : ", ", matcher.rules[i].pattern);
+        }
+        if (length < (int)sizeof(summary)) {
+            snprintf(summary + length, sizeof(summary) - length, "):");
+        }
 
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mode") == 0) {
-            if (i + 1 < argc) {
-                *mode = atoi(argv[++i]);
-                if (*mode < 1 || *mode > 3) {
-                    fprintf(stderr, "Invalid mode: %d\n", *mode);
-                    print_help();
-                    return 0;
-                }
-            } else {
-                fprintf(stderr, "Missing value for %s\n", argv[i]);
-                print_help();
-                return 0;
-            }
-        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--path") == 0) {
-            if (i + 1 < argc) {
-                *path = argv[++i];
-            } else {
-                fprintf(stderr, "Missing value for %s\n", argv[i]);
-                print_help();
-                return 0;
-            }
-        } else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--exclude") == 0) {
-            if (i + 1 < argc) {
-                *exclude = argv[++i];
-            } else {
-                fprintf(stderr, "Missing value for %s\n", argv[i]);
-                print_help();
-                return 0;
-            }
-        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timeout") == 0) {
-            if (i + 1 < argc) {
-                timeout_seconds = atoi(argv[++i]);
-                if (timeout_seconds <= 0) {
-                    fprintf(stderr, "Invalid timeout value: %d\n", timeout_seconds);
-                    print_help();
-                    return 0;
-                }
-            } else {
-                fprintf(stderr, "Missing value for %s\n", argv[i]);
-                print_help();
-                return 0;
-            }
-        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--depth") == 0) {
-            if (i + 1 < argc) {
-                max_depth = atoi(argv[++i]);
-                if (max_depth < 0 || max_depth > 10) {
-                    fprintf(stderr, "Invalid depth value: %d (must be between 0 and 10)\n", max_depth);
-                    print_help();
-                    return 0;
+        emit_text(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL, summary);
+
+        for (int i = 0; i < ctx->compose_file_count; i++) {
+            emit_text(ctx, CPMAN_EVENT_FILE_FOUND, CPMAN_LEVEL_INFO, ctx->compose_files[i], ctx->compose_files[i]);
+        }
+
+        for (int i = 0; i < ctx->compose_file_count; i++) {
+            char abs_path[PATH_MAX];
+            if (realpath(ctx->compose_files[i], abs_path) != NULL) {
+                char *temp = strdup(abs_path);
+                if (!temp) {
+                    emit_errno(ctx, "Failed to allocate memory");
+                    free_exclude_rules(&matcher);
+                    cpman_free_compose_files(ctx);
+                    return CPMAN_ERR_NOMEM;
                 }
+                free(ctx->compose_files[i]);
+                ctx->compose_files[i] = temp;
             } else {
-                fprintf(stderr, "Missing value for %s\n", argv[i]);
-                print_help();
-                return 0;
+                emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_ERROR, ctx->compose_files[i],
+                     "Error converting path to absolute: %s", ctx->compose_files[i]);
             }
-        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
-            verbose_mode = 1;
-        } else if (strcmp(argv[i], "--help") == 0) {
-            print_help();
-            exit(0);
-        } else {
-            fprintf(stderr, "Unknown option: %s\n", argv[i]);
-            print_help();
-            return 0;
         }
+    } else {
+        emit(ctx, CPMAN_EVENT_MESSAGE, CPMAN_LEVEL_NOTICE, NULL, "No compose files found.");
     }
 
-    return 1;
+    free_exclude_rules(&matcher);
+    return ctx->compose_file_count > 0 ? CPMAN_OK : CPMAN_ERR_NOT_FOUND;
 }
 
+void cpman_free_compose_files(cpman_ctx *ctx) {
+    free_string_list(ctx->compose_files, ctx->compose_file_count);
+    ctx->compose_files = NULL;
+    ctx->compose_file_count = 0;
+    ctx->compose_file_capacity = 0;
+}
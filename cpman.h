@@ -4,37 +4,149 @@
 #include <sys/types.h>
 #include <stddef.h>
 #include <limits.h>
+#include <pthread.h>
 
-#define GREEN "\033[0;32m"
-#define YELLOW "\033[0;33m"
-#define BLUE  "\033[0;34m"
-#define CYAN  "\033[0;36m"
-#define RED   "\033[0;31m"
-#define NC    "\033[0m"
-
-extern char COMPOSE_CMD[256];
-extern char DOCKER_CMD[256];
-extern char **compose_files;
-extern int compose_file_count;
-extern char *exclude_pattern;
-extern int verbose_mode;
-extern int timeout_seconds;
-extern int max_depth;
-
-void main_menu(int mode);
-void update_compose_files();
-void pause_all_compose();
-void start_all_compose();
-
-char *get_image_id(const char *file);
-int execute_command_with_timeout(const char *command, char *output, size_t output_size, const char *work_dir);
-void signal_handler(int sig);
-void check_command();
-void find_compose_files();
-void traverse_directories(const char *base_path, int depth);
-int is_valid_compose_file(const char *filepath);
-void free_compose_files();
-void print_help();
-int parse_args(int argc, char *argv[], int *mode, char **path, char **exclude);
+#define CPMAN_IGNORE_FILE_NAME ".cpmanignore"
+
+enum {
+    CPMAN_OK = 0,
+    CPMAN_ERR_SYSTEM = -1,
+    CPMAN_ERR_NOMEM = -2,
+    CPMAN_ERR_NO_RUNTIME = -3,
+    CPMAN_ERR_INVALID_PATTERN = -4,
+    CPMAN_ERR_NOT_FOUND = -5
+};
+
+/* Return codes of cpman_run_command() besides the command's exit status. */
+#define CPMAN_COMMAND_FAILED -1
+#define CPMAN_COMMAND_TIMEOUT -2
+
+typedef enum {
+    CPMAN_EVENT_MESSAGE,
+    CPMAN_EVENT_RUNTIME_DETECTED,
+    CPMAN_EVENT_FILE_FOUND,
+    CPMAN_EVENT_PROJECT_BEGIN,
+    CPMAN_EVENT_PROJECT_DONE,
+    CPMAN_EVENT_PROJECT_SKIPPED,
+    CPMAN_EVENT_PROJECT_FAILED,
+    CPMAN_EVENT_COMMAND,
+    CPMAN_EVENT_COMMAND_OUTPUT
+} cpman_event_type;
+
+typedef enum {
+    CPMAN_LEVEL_INFO,
+    CPMAN_LEVEL_NOTICE,
+    CPMAN_LEVEL_SUCCESS,
+    CPMAN_LEVEL_STATUS,
+    CPMAN_LEVEL_ERROR
+} cpman_level;
+
+typedef struct {
+    cpman_event_type type;
+    cpman_level level;
+    const char *project;  /* compose file the event is about, or NULL */
+    const char *message;  /* human-readable text without trailing newline */
+} cpman_event;
+
+typedef enum {
+    CPMAN_TIMEOUT_KILL,
+    CPMAN_TIMEOUT_WAIT
+} cpman_timeout_action;
+
+/*
+ * Host pressure as seen by the admission controller. cpu, io and memory are
+ * the PSI "some avg10" percentages; load is the 1-minute load average
+ * divided by the number of online CPUs.
+ */
+typedef struct {
+    double cpu;
+    double io;
+    double memory;
+    double load;
+} cpman_pressure;
+
+typedef void (*cpman_event_fn)(const cpman_event *event, void *userdata);
+typedef cpman_timeout_action (*cpman_timeout_fn)(const char *command, const char *output,
+                                                 int timeout_seconds, void *userdata);
+typedef int (*cpman_pressure_fn)(cpman_pressure *pressure, void *userdata);
+
+/*
+ * All state of one cpman instance. Initialise with cpman_init(), adjust the
+ * public settings, and release with cpman_cleanup(). Separate contexts are
+ * independent; the library keeps no process-global state and never calls
+ * exit() or changes the working directory.
+ */
+typedef struct cpman_ctx {
+    /* Settings */
+    int verbose;
+    int timeout_seconds;
+    int max_depth;
+    cpman_event_fn on_event;      /* NULL discards events */
+    cpman_timeout_fn on_timeout;  /* NULL kills timed-out commands */
+    void *userdata;
+
+    /*
+     * Start and update run up to max_jobs projects at once. New projects are
+     * only admitted while the host stays below pressure_limit; concurrency
+     * ramps up while it is idle and halves when a limit is exceeded.
+     */
+    int max_jobs;
+    int pull_jobs;  /* concurrency of the pull phase of cpman_staged_update() */
+    int check_jobs; /* concurrent config-hash and image checks before start and update */
+    cpman_pressure pressure_limit;
+    cpman_pressure_fn pressure_source;  /* NULL reads /proc */
+    void *pressure_userdata;
+
+    /*
+     * After a successful restart, remove the images each project used
+     * before the pull if no container references them anymore.
+     */
+    int gc_images;
+    int gc_ionice;  /* run the removal at idle IO priority */
+
+    /* Filled in by cpman_detect_runtime() */
+    char compose_cmd[256];
+    char docker_cmd[256];
+
+    /* Filled in by cpman_find_compose_files() */
+    char **compose_files;
+    int compose_file_count;
+    int compose_file_capacity;
+
+    char **exclude_patterns;
+    int exclude_pattern_count;
+    char **exclude_regexes;
+    int exclude_regex_count;
+
+    /* Serialises callbacks when projects run concurrently */
+    pthread_mutex_t callback_lock;
+} cpman_ctx;
+
+void cpman_init(cpman_ctx *ctx);
+void cpman_cleanup(cpman_ctx *ctx);
+const char *cpman_strerror(int err);
+
+int cpman_add_exclude(cpman_ctx *ctx, const char *pattern);
+int cpman_add_exclude_regex(cpman_ctx *ctx, const char *regex);
+
+int cpman_detect_runtime(cpman_ctx *ctx);
+int cpman_find_compose_files(cpman_ctx *ctx, const char *root);
+void cpman_free_compose_files(cpman_ctx *ctx);
+
+/* Operations return the number of projects that failed, or a negative error. */
+int cpman_update(cpman_ctx *ctx);
+/*
+ * Pulls and fingerprints every project first, then restarts only the
+ * changed ones one after another in discovery order.
+ */
+int cpman_staged_update(cpman_ctx *ctx);
+int cpman_stop(cpman_ctx *ctx);
+int cpman_fast_stop(cpman_ctx *ctx);
+int cpman_start(cpman_ctx *ctx);
+
+int cpman_run_command(cpman_ctx *ctx, const char *command, char *output, size_t output_size,
+                      const char *work_dir);
+int cpman_read_host_pressure(cpman_pressure *pressure, void *userdata);
+int cpman_image_fingerprint(cpman_ctx *ctx, const char *file, char *fingerprint, size_t size);
 
 #endif // CPMAN_H
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "cpman.h"
+
+#define GREEN "\033[0;32m"
+#define YELLOW "\033[0;33m"
+#define BLUE  "\033[0;34m"
+#define CYAN  "\033[0;36m"
+#define RED   "\033[0;31m"
+#define NC    "\033[0m"
+
+static cpman_ctx ctx;
+static int prefix_projects = 0;
+
+static void print_help();
+static int parse_args(int argc, char *argv[], cpman_ctx *ctx, int *mode, char **path);
+
+/*
+ * Worker threads may still hold the context and its locks, so only
+ * async-signal-safe calls are made here. The kernel releases the memory;
+ * cpman_cleanup() runs on the normal return path only.
+ */
+static void signal_handler(int sig) {
+    (void)sig;
+    static const char message[] = RED "\nExiting\n" NC;
+    ssize_t written = write(STDOUT_FILENO, message, sizeof(message) - 1);
+    (void)written;
+    _exit(1);
+}
+
+static const char *level_color(cpman_level level) {
+    switch (level) {
+    case CPMAN_LEVEL_NOTICE: return YELLOW;
+    case CPMAN_LEVEL_SUCCESS: return GREEN;
+    case CPMAN_LEVEL_STATUS: return BLUE;
+    case CPMAN_LEVEL_ERROR: return RED;
+    default: return CYAN;
+    }
+}
+
+static void print_event(const cpman_event *event, void *userdata) {
+    (void)userdata;
+
+    switch (event->type) {
+    case CPMAN_EVENT_FILE_FOUND:
+        printf("%s\n", event->message);
+        break;
+    case CPMAN_EVENT_COMMAND_OUTPUT:
+        printf(YELLOW "\n--- Command Output ---\n" NC);
+        printf("%s", event->message);
+        printf(YELLOW "\n--- End Output ---\n" NC);
+        break;
+    default:
+        if (prefix_projects && event->project && event->type != CPMAN_EVENT_PROJECT_BEGIN) {
+            printf("%s[%s] %s\n" NC, level_color(event->level), event->project, event->message);
+        } else {
+            printf("%s%s\n" NC, level_color(event->level), event->message);
+        }
+        break;
+    }
+}
+
+static cpman_timeout_action prompt_on_timeout(const char *command, const char *output,
+                                              int timeout_seconds, void *userdata) {
+    (void)command;
+    (void)userdata;
+
+    printf(RED "\nCommand timed out after %d seconds. Show output? [y/N]: " NC, timeout_seconds);
+    fflush(stdout);
+
+    char response[10] = {0};
+    if (fgets(response, sizeof(response), stdin) && (response[0] == 'y' || response[0] == 'Y')) {
+        printf(YELLOW "\n--- Command Output ---\n" NC);
+        printf("%s", output);
+        printf(YELLOW "\n--- End Output ---\n" NC);
+    }
+
+    printf(YELLOW "Terminate the process? [Y/n]: " NC);
+    fflush(stdout);
+    response[0] = '\0';
+    if (fgets(response, sizeof(response), stdin) && (response[0] == 'n' || response[0] == 'N')) {
+        return CPMAN_TIMEOUT_WAIT;
+    }
+    return CPMAN_TIMEOUT_KILL;
+}
+
+static int run_mode(int mode) {
+    switch (mode) {
+    case 1: return cpman_stop(&ctx);
+    case 2: return cpman_start(&ctx);
+    case 4: return cpman_fast_stop(&ctx);
+    case 5: return cpman_staged_update(&ctx);
+    default: return cpman_update(&ctx);
+    }
+}
+
+static int main_menu(int mode) {
+    if (mode >= 1 && mode <= 5) {
+        return run_mode(mode);
+    }
+
+    printf(YELLOW "Please select an option:\n" NC);
+    printf(GREEN "1) Stop all compose services\n" NC);
+    printf(GREEN "2) Start all compose services\n" NC);
+    printf(GREEN "3) Update all compose services (default)\n" NC);
+    printf(GREEN "4) Fast stop all compose services (batched)\n" NC);
+    printf(GREEN "5) Update all compose services in two phases (pull all, then restart)\n" NC);
+
+    char choice[10] = {0};
+    if (!fgets(choice, sizeof(choice), stdin)) choice[0] = '3';
+
+    return run_mode(choice[0] - '0');
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGINT, signal_handler);
+
+    cpman_init(&ctx);
+    ctx.on_event = print_event;
+    ctx.on_timeout = prompt_on_timeout;
+
+    int mode = 0;
+    char *path = NULL;
+
+    if (!parse_args(argc, argv, &ctx, &mode, &path)) {
+        cpman_cleanup(&ctx);
+        return 1;
+    }
+
+    prefix_projects = ctx.max_jobs > 1 || mode == 5;
+
+    if (path && chdir(path) != 0) {
+        perror("Failed to change directory");
+        cpman_cleanup(&ctx);
+        return 1;
+    }
+
+    if (cpman_detect_runtime(&ctx) != CPMAN_OK) {
+        cpman_cleanup(&ctx);
+        return 1;
+    }
+
+    int err = cpman_find_compose_files(&ctx, ".");
+    if (err == CPMAN_ERR_NOT_FOUND) {
+        printf(YELLOW "No compose files found. Did you specify the correct path? Try adjusting the depth with -d option.\n" NC);
+        cpman_cleanup(&ctx);
+        return 1;
+    } else if (err != CPMAN_OK) {
+        fprintf(stderr, RED "%s\n" NC, cpman_strerror(err));
+        cpman_cleanup(&ctx);
+        return 1;
+    }
+
+    main_menu(mode);
+
+    cpman_cleanup(&ctx);
+
+    return 0;
+}
+
+static void print_help() {
+    printf(CYAN "+----------------------------------+\n" NC);
+    printf(CYAN "|              " YELLOW "cpman" CYAN "               |\n" NC);
+    printf(CYAN "|    " GREEN "Compose Project Manager" CYAN "       |\n" NC);
+    printf(CYAN "+----------------------------------+\n\n" NC);
+
+    printf(YELLOW "Usage:" NC "  cpman [OPTIONS]\n\n");
+
+    printf(YELLOW "Options:\n" NC);
+    printf("  " GREEN "-p PATH" NC "  Search path for compose files\n");
+    printf("  " GREEN "-m MODE" NC "  Operation mode:\n");
+    printf("           " BLUE "1" NC ": Stop, " BLUE "2" NC ": Start, " BLUE "3" NC ": Update (default),\n");
+    printf("           " BLUE "4" NC ": Fast stop (all containers in one batch),\n");
+    printf("           " BLUE "5" NC ": Staged update (pull everything first, then restart)\n");
+    printf("  " GREEN "-e, --exclude PATTERN" NC " Exclude files/directories matching PATTERN\n");
+    printf("           (substring, or glob if it contains * ? [; repeatable)\n");
+    printf("  " GREEN "-E, --exclude-regex REGEX" NC " Exclude paths matching an extended regex (repeatable)\n");
+    printf("  " GREEN "-t, --timeout SECONDS" NC " Set command timeout (default: 60 seconds)\n");
+    printf("  " GREEN "-d, --depth LEVEL" NC " Set maximum directory search depth (default: 2)\n");
+    printf("  " GREEN "-j, --jobs N" NC " Start/update up to N projects at once while the host is idle (default: 1)\n");
+    printf("  " GREEN "--pull-jobs N" NC " Projects pulled at once in staged update (default: 4)\n");
+    printf("  " GREEN "--check-jobs N" NC " Configuration checks run at once before start/update (default: 4)\n");
+    printf("  " GREEN "--pressure-limit LIST" NC " Back off above these limits\n");
+    printf("           (default: cpu=80,io=40,memory=20,load=1.5; PSI avg10 %%, load per CPU; 0 disables)\n");
+    printf("  " GREEN "--gc" NC " After an update, remove the replaced images no container uses anymore\n");
+    printf("  " GREEN "--gc-ionice" NC " Like --gc, but run the removal at idle IO priority\n");
+    printf("  " GREEN "-v, --verbose" NC " Show command output on errors\n");
+    printf("  " GREEN "--help" NC "    Show this help message\n\n");
+
+    printf(YELLOW "Description:\n" NC);
+    printf("  Manages Docker Compose projects in the specified\n");
+    printf("  directory and its subdirectories.\n\n");
+
+    printf(YELLOW "Example:\n" NC);
+    printf("  cpman -p /projects -m 2 -t 120 -d 1\n\n");
+
+    printf(YELLOW "Note:" NC " Directories containing 'ignore' are skipped, and a " CPMAN_IGNORE_FILE_NAME "\n");
+    printf("  file in any directory excludes paths below it (gitignore syntax).\n");
+}
+
+static int parse_pressure_limit(const char *value, cpman_pressure *limit) {
+    char *copy = strdup(value);
+    if (!copy) return 0;
+
+    int valid = 1;
+    char *saveptr = NULL;
+    for (char *item = strtok_r(copy, ",", &saveptr); item && valid; item = strtok_r(NULL, ",", &saveptr)) {
+        char *separator = strchr(item, '=');
+        if (!separator) {
+            valid = 0;
+            break;
+        }
+        *separator = '\0';
+
+        char *end = NULL;
+        double number = strtod(separator + 1, &end);
+        if (end == separator + 1 || *end != '\0' || number < 0) {
+            valid = 0;
+        } else if (strcmp(item, "cpu") == 0) {
+            limit->cpu = number;
+        } else if (strcmp(item, "io") == 0) {
+            limit->io = number;
+        } else if (strcmp(item, "memory") == 0) {
+            limit->memory = number;
+        } else if (strcmp(item, "load") == 0) {
+            limit->load = number;
+        } else {
+            valid = 0;
+        }
+    }
+
+    free(copy);
+    return valid;
+}
+
+static int parse_args(int argc, char *argv[], cpman_ctx *ctx, int *mode, char **path) {
+    *mode = 3;
+    *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mode") == 0) {
+            if (i + 1 < argc) {
+                *mode = atoi(argv[++i]);
+                if (*mode < 1 || *mode > 5) {
+                    fprintf(stderr, "Invalid mode: %d\n", *mode);
+                    print_help();
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--path") == 0) {
+            if (i + 1 < argc) {
+                *path = argv[++i];
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--exclude") == 0) {
+            if (i + 1 < argc) {
+                if (cpman_add_exclude(ctx, argv[++i]) != CPMAN_OK) {
+                    fprintf(stderr, "%s\n", cpman_strerror(CPMAN_ERR_NOMEM));
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "-E") == 0 || strcmp(argv[i], "--exclude-regex") == 0) {
+            if (i + 1 < argc) {
+                if (cpman_add_exclude_regex(ctx, argv[++i]) != CPMAN_OK) {
+                    fprintf(stderr, "%s\n", cpman_strerror(CPMAN_ERR_NOMEM));
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timeout") == 0) {
+            if (i + 1 < argc) {
+                ctx->timeout_seconds = atoi(argv[++i]);
+                if (ctx->timeout_seconds <= 0) {
+                    fprintf(stderr, "Invalid timeout value: %d\n", ctx->timeout_seconds);
+                    print_help();
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--depth") == 0) {
+            if (i + 1 < argc) {
+                ctx->max_depth = atoi(argv[++i]);
+                if (ctx->max_depth < 0 || ctx->max_depth > 10) {
+                    fprintf(stderr, "Invalid depth value: %d (must be between 0 and 10)\n", ctx->max_depth);
+                    print_help();
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 < argc) {
+                ctx->max_jobs = atoi(argv[++i]);
+                if (ctx->max_jobs < 1) {
+                    fprintf(stderr, "Invalid jobs value: %d\n", ctx->max_jobs);
+                    print_help();
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--pull-jobs") == 0) {
+            if (i + 1 < argc) {
+                ctx->pull_jobs = atoi(argv[++i]);
+                if (ctx->pull_jobs < 1) {
+                    fprintf(stderr, "Invalid pull jobs value: %d\n", ctx->pull_jobs);
+                    print_help();
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--check-jobs") == 0) {
+            if (i + 1 < argc) {
+                ctx->check_jobs = atoi(argv[++i]);
+                if (ctx->check_jobs < 1) {
+                    fprintf(stderr, "Invalid check jobs value: %d\n", ctx->check_jobs);
+                    print_help();
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--pressure-limit") == 0) {
+            if (i + 1 < argc) {
+                if (!parse_pressure_limit(argv[++i], &ctx->pressure_limit)) {
+                    fprintf(stderr, "Invalid pressure limit: %s\n", argv[i]);
+                    print_help();
+                    return 0;
+                }
+            } else {
+                fprintf(stderr, "Missing value for %s\n", argv[i]);
+                print_help();
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--gc") == 0) {
+            ctx->gc_images = 1;
+        } else if (strcmp(argv[i], "--gc-ionice") == 0) {
+            ctx->gc_images = 1;
+            ctx->gc_ionice = 1;
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            ctx->verbose = 1;
+        } else if (strcmp(argv[i], "--help") == 0) {
+            print_help();
+            exit(0);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            print_help();
+            return 0;
+        }
+    }
+
+    return 1;
+}
+